@@ -0,0 +1,548 @@
+/*
+ * cache.c - shared in-memory web object cache for the proxy
+ *
+ * The cache is split into CACHE_SHARDS shards by key hash. Each shard
+ * has its own readers-writer lock, a small hash index and a ring of its
+ * objects, so threads working on different keys never touch the same
+ * lock. Lookups only take a shard's read lock, so they cannot move ring
+ * nodes; a hit just sets the object's referenced bit. Eviction is CLOCK
+ * (second chance): a hand walks the ring, clearing referenced bits and
+ * evicting the first object whose bit was already clear. New objects go
+ * in just behind the hand, so each gets a full turn before it can be
+ * chosen.
+ *
+ * MAX_CACHE_SIZE is still one global budget, kept in an atomic byte
+ * count. An insert that overflows it evicts from its own shard first
+ * and from the others in turn when its shard has nothing left, holding
+ * one shard lock at a time. Since keys spread evenly over the shards,
+ * per-shard CLOCK stays close to global LRU.
+ *
+ * With a disk tier configured (see disk.c), evicted objects are written
+ * there and a miss in memory checks it before going to the origin; an
+ * object found on disk is copied back into memory.
+ *
+ * Each object carries a freshness lifetime taken from its headers when
+ * it is stored: Cache-Control s-maxage or max-age, then Expires, then
+ * 10% of the time since Last-Modified, then CACHE_DEFAULT_TTL. Its
+ * ETag and Last-Modified are kept for revalidating it once it is stale;
+ * cacheRefresh() renews it after the origin answers 304, replacing it
+ * with a copy that carries the 304's validators if they changed.
+ */
+#include "csapp.h"
+#include "cache.h"
+#include "disk.h"
+
+typedef struct {
+    pthread_rwlock_t lock;
+    cacheObj_t* bucket[SHARD_BUCKETS];
+    cacheObj_t head;                /* sentinel of the shard's object ring */
+    cacheObj_t* hand;               /* CLOCK hand, walks the ring via prev */
+} shard_t;
+
+static shard_t shards[CACHE_SHARDS];
+static size_t cacheBytes;           /* atomic sum of size over linked objects */
+
+static unsigned int hashKey(const char* key);
+static cacheObj_t* findLocked(shard_t* sh, const char* key, unsigned int hash);
+static void unlinkLocked(shard_t* sh, cacheObj_t* obj);
+static cacheObj_t* newObj(const char* key, const char* data, size_t size, time_t fetched);
+static cacheObj_t* linkObj(cacheObj_t* obj, int wantRef);
+static cacheObj_t* promote(const char* key);
+static int evictOne(shard_t* sh, const cacheObj_t* keep);
+static long freshness(const char* data, size_t size, time_t now, cacheObj_t* obj, long fallback);
+static char* withValidators(const cacheObj_t* obj, const char* hdrs, size_t len, size_t* size);
+static const char* headerLine(const char* data, size_t size, const char* name, size_t* lineLen);
+static const char* findDirective(const char* value, size_t len, const char* name);
+static time_t httpDate(const char* value, size_t len);
+
+void cacheInit(void)
+{
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        pthread_rwlock_init(&shards[i].lock, NULL);
+        memset(shards[i].bucket, 0, sizeof(shards[i].bucket));
+        shards[i].head.prev = shards[i].head.next = &shards[i].head;
+        shards[i].hand = &shards[i].head;
+    }
+    cacheBytes = 0;
+}
+
+/*
+ * cacheKey - normalize <host, port, path> into a cache key: the host is
+ * lower-cased and the port is always explicit, so "HOST/x",
+ * "host:80/x" and "host/x" share one entry
+ */
+void cacheKey(char* key, size_t keyLen, const char* host, int port, const char* path)
+{
+    size_t i;
+
+    for (i = 0; host[i] && i < keyLen - 1; i++) {
+        key[i] = tolower((unsigned char)host[i]);
+    }
+    snprintf(key + i, keyLen - i, ":%d%s", port, *path ? path : "/");
+}
+
+/*
+ * cacheLookup - return the object cached under key with a reference
+ * held, or NULL on a miss
+ */
+cacheObj_t* cacheLookup(const char* key)
+{
+    unsigned int hash = hashKey(key);
+    shard_t* sh = &shards[hash % CACHE_SHARDS];
+    cacheObj_t* obj;
+
+    pthread_rwlock_rdlock(&sh->lock);
+    if ((obj = findLocked(sh, key, hash)) != NULL) {
+        __atomic_add_fetch(&obj->refCnt, 1, __ATOMIC_RELAXED);
+        if (!__atomic_load_n(&obj->referenced, __ATOMIC_RELAXED)) { // 已置位就不再写, 少点缓存行争用
+            __atomic_store_n(&obj->referenced, 1, __ATOMIC_RELAXED);
+        }
+    }
+    pthread_rwlock_unlock(&sh->lock);
+    if (obj == NULL) {
+        obj = promote(key);
+    }
+    return obj;
+}
+
+/*
+ * cacheRelease - drop a reference taken by cacheLookup()
+ */
+void cacheRelease(cacheObj_t* obj)
+{
+    if (__atomic_sub_fetch(&obj->refCnt, 1, __ATOMIC_ACQ_REL) == 0) {
+        Free(obj->key);
+        Free(obj->data);
+        Free(obj);
+    }
+}
+
+/*
+ * cacheInsert - copy a complete response into the cache, evicting
+ * objects not used lately until it fits
+ */
+void cacheInsert(const char* key, const char* data, size_t size)
+{
+    time_t now = time(NULL);
+
+    diskRemove(key); // 磁盘上的旧版本作废
+    if (size > MAX_OBJECT_SIZE || freshness(data, size, now, NULL, CACHE_DEFAULT_TTL) < 0) {
+        return;
+    }
+    linkObj(newObj(key, data, size, now), 0);
+}
+
+/*
+ * cacheStorable - may a response with this head of len bytes be cached
+ *     at all, going by its Cache-Control and Vary headers?
+ */
+int cacheStorable(const char* hdrs, size_t len)
+{
+    return freshness(hdrs, len, time(NULL), NULL, CACHE_DEFAULT_TTL) >= 0;
+}
+
+/* cacheFresh - may obj be served without asking the origin? */
+int cacheFresh(const cacheObj_t* obj)
+{
+    return time(NULL) < __atomic_load_n(&obj->expires, __ATOMIC_RELAXED);
+}
+
+/*
+ * cacheRefresh - the origin confirmed obj with a 304 whose len bytes of
+ *     headers are in hdrs; start a new freshness lifetime, the one the
+ *     304 grants or else the one obj had. New validators in the 304
+ *     replace obj in the cache with a copy whose head has them, since
+ *     objects are immutable; obj stays valid for the caller. A copy on
+ *     the disk tier is rewritten with the new fetch time.
+ */
+void cacheRefresh(cacheObj_t* obj, const char* hdrs, size_t len)
+{
+    time_t now = time(NULL);
+    long ttl = freshness(hdrs, len, now, NULL, obj->ttl);
+    size_t size;
+    char* data;
+
+    if (ttl < 0) {
+        ttl = 0;
+    }
+    __atomic_store_n(&obj->ttl, ttl, __ATOMIC_RELAXED);
+    __atomic_store_n(&obj->expires, now + ttl, __ATOMIC_RELAXED);
+    if ((data = withValidators(obj, hdrs, len, &size)) == NULL) {
+        diskRefresh(obj->key, obj->data, obj->size, now);
+        return;
+    }
+    cacheObj_t* renewed = newObj(obj->key, data, size, now);
+    Free(data);
+    renewed->ttl = ttl;
+    renewed->expires = now + ttl;
+    diskRefresh(renewed->key, renewed->data, renewed->size, now); // 链入后可能随时被逐出, 先写磁盘
+    linkObj(renewed, 0);
+}
+
+/* fetched is when the response left the origin, for its freshness */
+static cacheObj_t* newObj(const char* key, const char* data, size_t size, time_t fetched)
+{
+    cacheObj_t* obj = Malloc(sizeof(cacheObj_t));
+    obj->key = Malloc(strlen(key) + 1);
+    strcpy(obj->key, key);
+    obj->hash = hashKey(key);
+    obj->data = Malloc(size);
+    memcpy(obj->data, data, size);
+    obj->size = size;
+    obj->refCnt = 1; // the cache's own reference
+    obj->referenced = 0;
+    obj->etag = obj->lastModified = NULL;
+    obj->etagLen = obj->lastModifiedLen = 0;
+    obj->ttl = freshness(obj->data, size, fetched, obj, CACHE_DEFAULT_TTL);
+    if (obj->ttl < 0) {
+        obj->ttl = 0;
+    }
+    obj->expires = fetched + obj->ttl;
+    return obj;
+}
+
+/*
+ * linkObj - add a new object to its shard and evict down to the budget.
+ *     A fresh fetch replaces an object already cached under its key.
+ *     With wantRef (a copy from disk) the one already cached wins
+ *     instead, and whichever object is cached is returned with a
+ *     reference held for the caller.
+ */
+static cacheObj_t* linkObj(cacheObj_t* obj, int wantRef)
+{
+    unsigned int idx = obj->hash % CACHE_SHARDS;
+    shard_t* sh = &shards[idx];
+    cacheObj_t* old;
+
+    pthread_rwlock_wrlock(&sh->lock);
+    if ((old = findLocked(sh, obj->key, obj->hash)) != NULL && wantRef) { // 另一个线程已经抢先缓存了同一对象
+        __atomic_add_fetch(&old->refCnt, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&old->referenced, 1, __ATOMIC_RELAXED);
+        pthread_rwlock_unlock(&sh->lock);
+        cacheRelease(obj);
+        return old;
+    }
+    if (old != NULL) { // 新取回的版本替换旧的
+        unlinkLocked(sh, old);
+    }
+    cacheObj_t** bp = &sh->bucket[(obj->hash / CACHE_SHARDS) % SHARD_BUCKETS];
+    obj->hnext = *bp;
+    *bp = obj;
+    obj->prev = sh->hand; // 插在指针刚走过的位置, 要转满一圈才会轮到它
+    obj->next = sh->hand->next;
+    sh->hand->next->prev = obj;
+    sh->hand->next = obj;
+    if (wantRef) {
+        obj->refCnt++;
+        obj->referenced = 1;
+    }
+    size_t total = __atomic_add_fetch(&cacheBytes, obj->size, __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&sh->lock);
+    if (old != NULL) {
+        cacheRelease(old);
+    }
+
+    /* Over budget: own shard first, then the others, one lock at a time */
+    for (int i = 0; total > MAX_CACHE_SIZE && i < CACHE_SHARDS; ) {
+        if (!evictOne(&shards[(idx + i) % CACHE_SHARDS], obj)) {
+            i++;
+        }
+        total = __atomic_load_n(&cacheBytes, __ATOMIC_RELAXED);
+    }
+    return obj;
+}
+
+/* Bring an object back from the disk tier; NULL if it is not there */
+static cacheObj_t* promote(const char* key)
+{
+    diskMap_t m;
+
+    if (diskOpen(key, &m) < 0) {
+        return NULL;
+    }
+    if (m.size > MAX_OBJECT_SIZE) {
+        diskClose(&m);
+        return NULL;
+    }
+    cacheObj_t* obj = newObj(key, m.data, m.size, m.fetched);
+    diskClose(&m);
+    return linkObj(obj, 1);
+}
+
+/*
+ * withValidators - copy obj's response with its ETag and Last-Modified
+ *     lines replaced by those in the len bytes of hdrs, setting *size.
+ *     NULL if hdrs carries neither, or nothing that differs, or the
+ *     copy would not fit MAX_OBJECT_SIZE.
+ */
+static char* withValidators(const cacheObj_t* obj, const char* hdrs, size_t len, size_t* size)
+{
+    const char* names[2] = { "ETag:", "Last-Modified:" };
+    const char* lines[2];
+    size_t lineLens[2];
+    int changed = 0;
+
+    for (int i = 0; i < 2; i++) {
+        size_t oldLen;
+        const char* old = headerLine(obj->data, obj->size, names[i], &oldLen);
+        lines[i] = headerLine(hdrs, len, names[i], &lineLens[i]);
+        changed |= lines[i] != NULL && (old == NULL || oldLen != lineLens[i]
+                                        || memcmp(old, lines[i], oldLen) != 0);
+    }
+    const char* end = obj->data + obj->size;
+    const char* p = memchr(obj->data, '\n', obj->size); // 状态行原样保留
+    if (!changed || p == NULL || obj->size + lineLens[0] + lineLens[1] > MAX_OBJECT_SIZE) {
+        return NULL;
+    }
+
+    char* data = Malloc(obj->size + lineLens[0] + lineLens[1]);
+    size_t n = ++p - obj->data;
+    memcpy(data, obj->data, n);
+    while (p < end && *p != '\r' && *p != '\n') {
+        const char* eol = memchr(p, '\n', end - p);
+        if (eol == NULL) {
+            Free(data);
+            return NULL;
+        }
+        eol++;
+        if (!(lines[0] != NULL && strncasecmp(p, names[0], strlen(names[0])) == 0)
+            && !(lines[1] != NULL && strncasecmp(p, names[1], strlen(names[1])) == 0)) {
+            memcpy(data + n, p, eol - p);
+            n += eol - p;
+        }
+        p = eol;
+    }
+    for (int i = 0; i < 2; i++) {
+        if (lines[i] != NULL) {
+            memcpy(data + n, lines[i], lineLens[i]);
+            n += lineLens[i];
+        }
+    }
+    memcpy(data + n, p, end - p); // 空行和 body
+    *size = n + (end - p);
+    return data;
+}
+
+/*
+ * headerLine - find the header line called name (with its colon) in
+ *     the head at data; returns its start and sets *lineLen to its
+ *     length with the line end, or returns NULL
+ */
+static const char* headerLine(const char* data, size_t size, const char* name, size_t* lineLen)
+{
+    const char* end = data + size;
+    const char* p = memchr(data, '\n', size); // 跳过状态行
+    size_t nameLen = strlen(name);
+
+    while (p != NULL && ++p < end && *p != '\r' && *p != '\n') {
+        const char* eol = memchr(p, '\n', end - p);
+        if (eol == NULL) {
+            break;
+        }
+        if ((size_t)(eol - p) >= nameLen && strncasecmp(p, name, nameLen) == 0) {
+            *lineLen = eol + 1 - p;
+            return p;
+        }
+        p = eol;
+    }
+    *lineLen = 0;
+    return NULL;
+}
+
+/* FNV-1a */
+static unsigned int hashKey(const char* key)
+{
+    unsigned int h = 2166136261u;
+
+    while (*key) {
+        h = (h ^ (unsigned char)*key++) * 16777619u;
+    }
+    return h;
+}
+
+static cacheObj_t* findLocked(shard_t* sh, const char* key, unsigned int hash)
+{
+    cacheObj_t* p = sh->bucket[(hash / CACHE_SHARDS) % SHARD_BUCKETS];
+
+    for (; p != NULL; p = p->hnext) {
+        if (p->hash == hash && strcmp(p->key, key) == 0) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+static void unlinkLocked(shard_t* sh, cacheObj_t* obj)
+{
+    cacheObj_t** bp = &sh->bucket[(obj->hash / CACHE_SHARDS) % SHARD_BUCKETS];
+
+    while (*bp != obj) {
+        bp = &(*bp)->hnext;
+    }
+    *bp = obj->hnext;
+    if (sh->hand == obj) {
+        sh->hand = obj->prev;
+    }
+    obj->prev->next = obj->next;
+    obj->next->prev = obj->prev;
+    __atomic_sub_fetch(&cacheBytes, obj->size, __ATOMIC_RELAXED);
+}
+
+/*
+ * evictOne - advance the shard's CLOCK hand to an object other than keep
+ *     (the object being inserted) that was not referenced since the
+ *     hand last passed it, and drop it. Returns 0 if there was none.
+ *     Three passes of the sentinel mean every object was seen twice.
+ */
+static int evictOne(shard_t* sh, const cacheObj_t* keep)
+{
+    cacheObj_t* victim = NULL;
+    int laps = 0;
+
+    pthread_rwlock_wrlock(&sh->lock);
+    for (cacheObj_t* p = sh->hand; laps < 3; p = p->prev) {
+        if (p == &sh->head) {
+            laps++;
+        } else if (p != keep) {
+            if (!__atomic_load_n(&p->referenced, __ATOMIC_RELAXED)) {
+                victim = p;
+                break;
+            }
+            __atomic_store_n(&p->referenced, 0, __ATOMIC_RELAXED);
+        }
+    }
+    if (victim == NULL) {
+        pthread_rwlock_unlock(&sh->lock);
+        return 0;
+    }
+    sh->hand = victim; // 摘下后指针停在它前一个
+    unlinkLocked(sh, victim);
+    pthread_rwlock_unlock(&sh->lock);
+    diskStore(victim->key, victim->data, victim->size, victim->expires - victim->ttl);
+    cacheRelease(victim); // readers still sending it keep it alive
+    return 1;
+}
+
+/*
+ * freshness - read the caching rules in a response head of size bytes,
+ *     received at time now. Returns its freshness lifetime in seconds,
+ *     fallback if it states none, or -1 if it must not be stored. If
+ *     obj is given its validators are pointed at data.
+ */
+static long freshness(const char* data, size_t size, time_t now, cacheObj_t* obj, long fallback)
+{
+    const char* end = data + size;
+    const char* p = memchr(data, '\n', size); // 跳过状态行
+    long maxAge = -1;
+    long sMaxAge = -1;
+    int noCache = 0;
+    time_t expires = -1;
+    time_t date = -1;
+    time_t lastModified = -1;
+
+    while (p != NULL && ++p < end && *p != '\r' && *p != '\n') {
+        const char* eol = memchr(p, '\n', end - p);
+        const char* colon = memchr(p, ':', (eol ? eol : end) - p);
+        if (eol == NULL || colon == NULL) {
+            break;
+        }
+        const char* value = colon + 1;
+        while (value < eol && *value == ' ') {
+            value++;
+        }
+        size_t len = eol - value;
+        if (len > 0 && value[len - 1] == '\r') {
+            len--;
+        }
+
+        if (strncasecmp(p, "Cache-Control:", 14) == 0) {
+            const char* d;
+            if (findDirective(value, len, "no-store") || findDirective(value, len, "private")) {
+                return -1;
+            }
+            noCache |= findDirective(value, len, "no-cache") != NULL;
+            if ((d = findDirective(value, len, "max-age=")) != NULL) {
+                maxAge = strtol(d, NULL, 10);
+            }
+            if ((d = findDirective(value, len, "s-maxage=")) != NULL) {
+                sMaxAge = strtol(d, NULL, 10);
+            }
+        } else if (strncasecmp(p, "Expires:", 8) == 0) {
+            expires = httpDate(value, len);
+        } else if (strncasecmp(p, "Date:", 5) == 0) {
+            date = httpDate(value, len);
+        } else if (strncasecmp(p, "Last-Modified:", 14) == 0) {
+            lastModified = httpDate(value, len);
+            if (obj != NULL) {
+                obj->lastModified = value;
+                obj->lastModifiedLen = len;
+            }
+        } else if (strncasecmp(p, "Vary:", 5) == 0) { // 键里只有 URL, 存不下多个变体
+            return -1;
+        } else if (strncasecmp(p, "ETag:", 5) == 0 && obj != NULL) {
+            obj->etag = value;
+            obj->etagLen = len;
+        }
+        p = eol;
+    }
+
+    if (noCache) { // 可以缓存, 但每次都要先验证
+        return 0;
+    }
+    if (sMaxAge >= 0) {
+        return sMaxAge;
+    }
+    if (maxAge >= 0) {
+        return maxAge;
+    }
+    if (expires != -1) { // 无法解析的 Expires 视为已过期
+        long ttl = expires - (date > 0 ? date : now);
+        return ttl > 0 ? ttl : 0;
+    }
+    if (lastModified > 0 && lastModified < now) {
+        long ttl = (now - lastModified) / 10;
+        return ttl < CACHE_HEURISTIC_MAX ? ttl : CACHE_HEURISTIC_MAX;
+    }
+    return fallback;
+}
+
+/* Find a Cache-Control directive; returns what follows its name */
+static const char* findDirective(const char* value, size_t len, const char* name)
+{
+    size_t n = strlen(name);
+
+    for (size_t i = 0; i + n <= len; i++) {
+        if ((i == 0 || value[i - 1] == ' ' || value[i - 1] == ',')
+            && strncasecmp(value + i, name, n) == 0) {
+            return value + i + n;
+        }
+    }
+    return NULL;
+}
+
+/* Parse an RFC 1123 date ("Sun, 06 Nov 1994 08:49:37 GMT"); 0 if invalid */
+static time_t httpDate(const char* value, size_t len)
+{
+    static const char* months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    char buf[64];
+    char mon[4];
+    struct tm tm;
+
+    if (len >= sizeof(buf)) {
+        return 0;
+    }
+    memcpy(buf, value, len);
+    buf[len] = 0;
+    memset(&tm, 0, sizeof(tm));
+    if (sscanf(buf, "%*[^,], %d %3s %d %d:%d:%d", &tm.tm_mday, mon, &tm.tm_year,
+               &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6) {
+        return 0;
+    }
+    const char* m = strstr(months, mon);
+    if (m == NULL || (m - months) % 3 != 0) {
+        return 0;
+    }
+    tm.tm_mon = (m - months) / 3;
+    tm.tm_year -= 1900;
+    return timegm(&tm);
+}
@@ -0,0 +1,58 @@
+/*
+ * cache.h - shared in-memory web object cache for the proxy
+ */
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include "csapp.h"
+
+/* Recommended max cache and object sizes */
+#define MAX_CACHE_SIZE 1049000
+#define MAX_OBJECT_SIZE 102400
+
+/* Freshness lifetime when a response carries no caching information */
+#define CACHE_DEFAULT_TTL 300
+#define CACHE_HEURISTIC_MAX 86400   /* cap on the Last-Modified heuristic */
+
+/*
+ * Shards each have their own lock, index and CLOCK ring; a power of two.
+ * cachebench builds the cache with other counts through -DCACHE_SHARDS.
+ */
+#ifndef CACHE_SHARDS
+#define CACHE_SHARDS 16
+#endif
+#define SHARD_BUCKETS 64
+
+/*
+ * A cached response. Objects are immutable once inserted; the cache
+ * holds one reference and every reader that got the object from
+ * cacheLookup() holds another until cacheRelease().
+ */
+typedef struct cacheObj {
+    char* key;                  /* normalized url, see cacheKey() */
+    unsigned int hash;          /* of key; picks the shard and bucket */
+    char* data;                 /* full response, status line included */
+    size_t size;                /* bytes in data */
+    int refCnt;                 /* atomic, object freed when it drops to 0 */
+    int referenced;             /* atomic CLOCK bit, set on every hit */
+    time_t expires;             /* atomic, fresh until then; see cacheFresh() */
+    long ttl;                   /* atomic, freshness lifetime last granted */
+    const char* etag;           /* validators, pointing into data; NULL if absent */
+    size_t etagLen;
+    const char* lastModified;
+    size_t lastModifiedLen;
+    struct cacheObj* prev;      /* shard CLOCK ring */
+    struct cacheObj* next;
+    struct cacheObj* hnext;     /* shard hash chain */
+} cacheObj_t;
+
+void cacheInit(void);
+void cacheKey(char* key, size_t keyLen, const char* host, int port, const char* path);
+cacheObj_t* cacheLookup(const char* key);
+void cacheRelease(cacheObj_t* obj);
+void cacheInsert(const char* key, const char* data, size_t size);
+int cacheStorable(const char* hdrs, size_t len);
+int cacheFresh(const cacheObj_t* obj);
+void cacheRefresh(cacheObj_t* obj, const char* hdrs, size_t len);
+
+#endif /* __CACHE_H__ */
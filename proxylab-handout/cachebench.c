@@ -0,0 +1,92 @@
+/*
+ * cachebench.c - concurrent cacheLookup() throughput
+ *
+ * Fills the cache with small objects, then has each of 1, 2, 4, ...
+ * threads look up and release random keys from the set as fast as it
+ * can, and prints the total lookups per second. The Makefile links it
+ * against cache.c built with several CACHE_SHARDS values; one shard is
+ * one lock for the whole cache, as before the cache was sharded, so
+ * the rows show how lookups scale with threads at each shard count.
+ * Scaling needs as many CPUs as threads.
+ *
+ * usage: cachebench [maxthreads [lookups-per-thread]]
+ */
+#include "csapp.h"
+#include "cache.h"
+
+#define NKEYS 512                   /* 512 objects of 1 KB fit MAX_CACHE_SIZE */
+#define OBJ_BODY 1024
+#define DEFAULT_MAXTHREADS 8
+#define DEFAULT_LOOKUPS 2000000
+
+static char keys[NKEYS][MAXLINE];
+static long lookups;
+
+static long nowNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static void* lookupThread(void* vargp)
+{
+    unsigned int seed = (unsigned int)(long)vargp;
+    long misses = 0;
+
+    for (long i = 0; i < lookups; i++) {
+        cacheObj_t* obj = cacheLookup(keys[rand_r(&seed) % NKEYS]);
+        if (obj == NULL) {
+            misses++;
+        } else {
+            cacheRelease(obj);
+        }
+    }
+    return (void*)misses;
+}
+
+int main(int argc, char** argv)
+{
+    int maxThreads = argc > 1 ? atoi(argv[1]) : DEFAULT_MAXTHREADS;
+    char data[MAXLINE + OBJ_BODY];
+    pthread_t tids[maxThreads > 0 ? maxThreads : 1];
+
+    lookups = argc > 2 ? atol(argv[2]) : DEFAULT_LOOKUPS;
+    if (maxThreads <= 0 || lookups <= 0) {
+        fprintf(stderr, "usage: %s [maxthreads [lookups-per-thread]]\n", argv[0]);
+        exit(1);
+    }
+
+    cacheInit();
+    int hdrLen = snprintf(data, MAXLINE, "HTTP/1.0 200 OK\r\nContent-Length: %d\r\n"
+                          "Cache-Control: max-age=3600\r\n\r\n", OBJ_BODY);
+    memset(data + hdrLen, 'x', OBJ_BODY);
+    for (int i = 0; i < NKEYS; i++) {
+        cacheKey(keys[i], MAXLINE, "bench.example.com", 80, "/");
+        snprintf(keys[i] + strlen(keys[i]), MAXLINE - strlen(keys[i]), "object/%d", i);
+        cacheInsert(keys[i], data, hdrLen + OBJ_BODY);
+    }
+
+    printf("%2d shards:", CACHE_SHARDS);
+    for (int n = 1; n <= maxThreads; n *= 2) {
+        long misses = 0;
+        long start = nowNs();
+        for (int i = 0; i < n; i++) {
+            Pthread_create(&tids[i], NULL, lookupThread, (void*)(long)(i + 1));
+        }
+        for (int i = 0; i < n; i++) {
+            void* m;
+            Pthread_join(tids[i], &m);
+            misses += (long)m;
+        }
+        double secs = (nowNs() - start) / 1e9;
+        printf("  %d thr %6.2fM/s", n, n * lookups / secs / 1e6);
+        if (misses > 0) {
+            printf(" (%ld misses)", misses);
+        }
+        fflush(stdout);
+    }
+    printf("\n");
+    return 0;
+}
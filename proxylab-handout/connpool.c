@@ -0,0 +1,124 @@
+/*
+ * connpool.c - per-origin pool of idle upstream connections
+ *
+ * After a response has been read completely from a persistent server
+ * connection, forward() parks the socket here instead of closing it.
+ * The next request to the same host:port takes it back and skips DNS
+ * and the TCP handshake. Idle sockets live in a small hash table of
+ * per-origin stacks guarded by one mutex; all operations are short.
+ */
+#include "csapp.h"
+#include "connpool.h"
+
+#define POOL_BUCKETS 64
+
+typedef struct poolEntry {
+    char* origin;              /* "host:port" */
+    int fd;
+    time_t idleSince;
+    struct poolEntry* next;
+} poolEntry_t;
+
+static poolEntry_t* buckets[POOL_BUCKETS];
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int hashOrigin(const char* origin);
+static int stillOpen(int fd);
+
+/*
+ * poolGet - take an idle connection to host:port out of the pool.
+ *     Returns its descriptor, or -1 if there is none.
+ */
+int poolGet(const char* host, int port)
+{
+    char origin[MAXLINE];
+    time_t now = time(NULL);
+    int fd = -1;
+
+    snprintf(origin, sizeof(origin), "%s:%d", host, port);
+    poolEntry_t** pp = &buckets[hashOrigin(origin)];
+
+    pthread_mutex_lock(&poolLock);
+    while (*pp != NULL) {
+        poolEntry_t* e = *pp;
+        if (strcasecmp(e->origin, origin) != 0) {
+            pp = &e->next;
+            continue;
+        }
+        *pp = e->next;
+        if (fd < 0 && now - e->idleSince < POOL_IDLE_TIMEOUT) {
+            fd = e->fd;
+        } else {
+            close(e->fd); // 超时的连接顺便清理掉
+        }
+        Free(e->origin);
+        Free(e);
+        if (fd >= 0) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&poolLock);
+
+    if (fd >= 0 && !stillOpen(fd)) { // server 已经关闭了这个空闲连接
+        close(fd);
+        return poolGet(host, port);
+    }
+    return fd;
+}
+
+/*
+ * poolPut - park a connection whose last response was read completely.
+ *     Closes it instead if the origin already has enough idle sockets.
+ */
+void poolPut(const char* host, int port, int fd)
+{
+    char origin[MAXLINE];
+    int count = 0;
+
+    snprintf(origin, sizeof(origin), "%s:%d", host, port);
+    unsigned int h = hashOrigin(origin);
+
+    poolEntry_t* e = Malloc(sizeof(poolEntry_t));
+    e->origin = Malloc(strlen(origin) + 1);
+    strcpy(e->origin, origin);
+    e->fd = fd;
+    e->idleSince = time(NULL);
+
+    pthread_mutex_lock(&poolLock);
+    for (poolEntry_t* p = buckets[h]; p != NULL; p = p->next) {
+        if (strcasecmp(p->origin, origin) == 0) {
+            count++;
+        }
+    }
+    if (count < POOL_MAX_PER_ORIGIN) {
+        e->next = buckets[h];
+        buckets[h] = e;
+        e = NULL;
+    }
+    pthread_mutex_unlock(&poolLock);
+
+    if (e != NULL) {
+        close(fd);
+        Free(e->origin);
+        Free(e);
+    }
+}
+
+static unsigned int hashOrigin(const char* origin)
+{
+    unsigned int h = 5381;
+
+    while (*origin) {
+        h = h * 33 + tolower((unsigned char)*origin++);
+    }
+    return h % POOL_BUCKETS;
+}
+
+/* An idle connection must have nothing to read: no data and no EOF */
+static int stillOpen(int fd)
+{
+    char c;
+    ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
@@ -0,0 +1,13 @@
+/*
+ * connpool.h - per-origin pool of idle upstream connections
+ */
+#ifndef __CONNPOOL_H__
+#define __CONNPOOL_H__
+
+#define POOL_MAX_PER_ORIGIN 8   /* idle sockets kept per host:port */
+#define POOL_IDLE_TIMEOUT 30    /* seconds before an idle socket is dropped */
+
+int poolGet(const char* host, int port);
+void poolPut(const char* host, int port, int fd);
+
+#endif /* __CONNPOOL_H__ */
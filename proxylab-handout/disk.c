@@ -0,0 +1,383 @@
+/*
+ * disk.c - optional on-disk second tier behind the memory cache
+ *
+ * Objects evicted from memory are written to one file each in the
+ * tier's directory, named by a 64-bit hash of the cache key. A file
+ * holds a small header, the key and the response, so the index (key,
+ * file size, last use) can be rebuilt at startup from the headers
+ * alone; bodies are only touched when a miss in memory maps one back
+ * in with mmap(). Files are written under a temporary name and
+ * renamed into place, so a crash never leaves a torn object behind.
+ *
+ * The tier is bounded by maxBytes and evicts its least recently used
+ * files. The index is guarded by one mutex that is never held while an
+ * object is read or written. A store claims its key in the index
+ * before writing and renames the file into place under the mutex only
+ * if the claim survived, so a diskRemove() meanwhile is never undone.
+ * Every function is a no-op until diskInit() succeeds.
+ */
+#include <dirent.h>
+#include <stdint.h>
+
+#include "csapp.h"
+#include "disk.h"
+
+#define DISK_BUCKETS 1024
+#define DISK_MAGIC "PXC2"
+
+/* On-disk header, followed by keyLen key bytes and size data bytes */
+typedef struct {
+    char magic[4];
+    uint32_t keyLen;
+    uint64_t size;
+    int64_t fetched;
+} diskHdr_t;
+
+typedef struct diskEntry {
+    char* key;
+    uint64_t hash;
+    size_t fileSize;
+    time_t lastUse;
+    int pending;                    /* claimed by a diskStore() still writing */
+    unsigned long seq;              /* that store's temporary file number */
+    struct diskEntry* next;
+} diskEntry_t;
+
+static char* diskDir;               /* NULL while the tier is disabled */
+static size_t diskMax;
+static size_t diskBytes;
+static diskEntry_t* buckets[DISK_BUCKETS];
+static pthread_mutex_t diskLock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long tmpSeq;        /* atomic, makes temporary names unique */
+
+static void rebuildIndex(void);
+static int readHeader(int fd, diskHdr_t* hdr, char* key, size_t keyCap);
+static diskEntry_t* addLocked(const char* key, uint64_t hash, size_t fileSize, time_t lastUse);
+static diskEntry_t* findLocked(const char* key);
+static void removeLocked(diskEntry_t* e);
+static void evictLocked(size_t need);
+static void filePath(char* path, size_t len, uint64_t hash);
+static uint64_t hashKey(const char* key);
+
+/*
+ * diskInit - enable the tier in dir (created if missing), at most
+ *     maxBytes large, and index whatever a previous run left there.
+ *     Problems with the directory only disable the tier.
+ */
+void diskInit(const char* dir, size_t maxBytes)
+{
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        fprintf(stderr, "disk cache disabled: mkdir %s: %s\n", dir, strerror(errno));
+        return;
+    }
+    diskDir = Malloc(strlen(dir) + 1);
+    strcpy(diskDir, dir);
+    diskMax = maxBytes;
+    rebuildIndex();
+}
+
+/*
+ * diskOpen - map the object cached under key. Returns 0 and fills m on
+ *     a hit, -1 on a miss.
+ */
+int diskOpen(const char* key, diskMap_t* m)
+{
+    char path[MAXLINE];
+    struct stat st;
+    diskHdr_t hdr;
+    uint64_t hash = hashKey(key);
+    size_t keyLen = strlen(key);
+
+    if (diskDir == NULL) {
+        return -1;
+    }
+    pthread_mutex_lock(&diskLock);
+    diskEntry_t* e = findLocked(key);
+    int hit = e != NULL && !e->pending;
+    if (hit) {
+        e->lastUse = time(NULL);
+    }
+    pthread_mutex_unlock(&diskLock);
+    if (!hit) {
+        return -1;
+    }
+
+    /* The file may be evicted or replaced under us; the header tells */
+    filePath(path, sizeof(path), hash);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, &st) < 0 || st.st_size < sizeof(hdr) + keyLen) {
+        close(fd);
+        return -1;
+    }
+    m->mapLen = st.st_size;
+    m->base = mmap(NULL, m->mapLen, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (m->base == MAP_FAILED) {
+        return -1;
+    }
+    memcpy(&hdr, m->base, sizeof(hdr));
+    if (memcmp(hdr.magic, DISK_MAGIC, 4) != 0 || hdr.keyLen != keyLen
+        || sizeof(hdr) + keyLen + hdr.size != m->mapLen
+        || memcmp((char*)m->base + sizeof(hdr), key, keyLen) != 0) { // 哈希冲突或文件损坏
+        munmap(m->base, m->mapLen);
+        return -1;
+    }
+    m->data = (char*)m->base + sizeof(hdr) + keyLen;
+    m->size = hdr.size;
+    m->fetched = hdr.fetched;
+    return 0;
+}
+
+void diskClose(diskMap_t* m)
+{
+    munmap(m->base, m->mapLen);
+}
+
+/*
+ * diskStore - write an object evicted from memory to the tier, unless
+ *     an up to date copy is already there
+ */
+void diskStore(const char* key, const char* data, size_t size, time_t fetched)
+{
+    char tmp[MAXLINE];
+    char path[MAXLINE];
+    diskHdr_t hdr;
+    uint64_t hash = hashKey(key);
+    size_t keyLen = strlen(key);
+    size_t fileSize = sizeof(hdr) + keyLen + size;
+
+    if (diskDir == NULL || fileSize > diskMax) {
+        return;
+    }
+    unsigned long seq = __atomic_add_fetch(&tmpSeq, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&diskLock);
+    int present = findLocked(key) != NULL;
+    if (!present) { // 先占位, 写完前的 diskRemove 会删掉占位
+        diskEntry_t* e = addLocked(key, hash, 0, time(NULL));
+        e->pending = 1;
+        e->seq = seq;
+    }
+    pthread_mutex_unlock(&diskLock);
+    if (present) {
+        return;
+    }
+
+    snprintf(tmp, sizeof(tmp), "%s/.tmp.%d.%lu", diskDir, (int)getpid(), seq);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    memcpy(hdr.magic, DISK_MAGIC, 4);
+    hdr.keyLen = keyLen;
+    hdr.size = size;
+    hdr.fetched = fetched;
+    int ok = fd >= 0
+        && rio_writen(fd, &hdr, sizeof(hdr)) == sizeof(hdr)
+        && rio_writen(fd, (void*)key, keyLen) == keyLen
+        && rio_writen(fd, (void*)data, size) == size;
+    ok = (fd < 0 || close(fd) == 0) && ok;
+    filePath(path, sizeof(path), hash);
+
+    /* Publish only if our claim is still there; rename() is atomic */
+    pthread_mutex_lock(&diskLock);
+    diskEntry_t* e = findLocked(key);
+    int claimed = e != NULL && e->pending && e->seq == seq;
+    if (claimed && ok && rename(tmp, path) == 0) {
+        e->pending = 0;
+        e->fileSize = fileSize;
+        e->lastUse = time(NULL);
+        diskBytes += fileSize;
+        evictLocked(0);
+    } else {
+        if (claimed) {
+            removeLocked(e);
+        }
+        unlink(tmp);
+    }
+    pthread_mutex_unlock(&diskLock);
+}
+
+/* diskRemove - drop key from the tier, e.g. because it was refetched */
+void diskRemove(const char* key)
+{
+    if (diskDir == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&diskLock);
+    diskEntry_t* e = findLocked(key);
+    if (e != NULL) {
+        removeLocked(e);
+    }
+    pthread_mutex_unlock(&diskLock);
+}
+
+/*
+ * diskRefresh - the memory copy of key was revalidated: if the tier
+ *     holds key, replace its file with data, fetched at the new time
+ */
+void diskRefresh(const char* key, const char* data, size_t size, time_t fetched)
+{
+    if (diskDir == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&diskLock);
+    diskEntry_t* e = findLocked(key);
+    int held = e != NULL && !e->pending;
+    if (held) {
+        removeLocked(e);
+    }
+    pthread_mutex_unlock(&diskLock);
+    if (held) {
+        diskStore(key, data, size, fetched);
+    }
+}
+
+/* Index every object file in diskDir; stray temporary files are removed */
+static void rebuildIndex(void)
+{
+    char path[MAXLINE];
+    char key[MAXLINE];
+    struct dirent* de;
+    struct stat st;
+    diskHdr_t hdr;
+    int n = 0;
+
+    DIR* d = opendir(diskDir);
+    if (d == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&diskLock);
+    while ((de = readdir(d)) != NULL) {
+        snprintf(path, sizeof(path), "%s/%s", diskDir, de->d_name);
+        if (strncmp(de->d_name, ".tmp.", 5) == 0) {
+            unlink(path); // 上次运行中断时留下的
+            continue;
+        }
+        if (de->d_name[0] == '.' || strlen(de->d_name) != 16) {
+            continue;
+        }
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            continue;
+        }
+        if (fstat(fd, &st) == 0 && readHeader(fd, &hdr, key, sizeof(key)) == 0
+            && sizeof(hdr) + hdr.keyLen + hdr.size == st.st_size
+            && hashKey(key) == strtoull(de->d_name, NULL, 16)) {
+            addLocked(key, hashKey(key), st.st_size, st.st_mtime);
+            n++;
+        } else {
+            unlink(path);
+        }
+        close(fd);
+    }
+    evictLocked(0); // 目录可能比这次配置的上限大
+    pthread_mutex_unlock(&diskLock);
+    closedir(d);
+    printf("disk cache %s: %d objects, %zu bytes\n", diskDir, n, diskBytes);
+    fflush(stdout);
+}
+
+static int readHeader(int fd, diskHdr_t* hdr, char* key, size_t keyCap)
+{
+    if (rio_readn(fd, hdr, sizeof(*hdr)) != sizeof(*hdr)
+        || memcmp(hdr->magic, DISK_MAGIC, 4) != 0 || hdr->keyLen >= keyCap
+        || rio_readn(fd, key, hdr->keyLen) != hdr->keyLen) {
+        return -1;
+    }
+    key[hdr->keyLen] = 0;
+    return 0;
+}
+
+/* Add or refresh an entry; another key with the same hash is dropped */
+static diskEntry_t* addLocked(const char* key, uint64_t hash, size_t fileSize, time_t lastUse)
+{
+    diskEntry_t** pp = &buckets[hash % DISK_BUCKETS];
+
+    while (*pp != NULL) {
+        diskEntry_t* e = *pp;
+        if (e->hash == hash) { // 同名文件已被覆盖
+            *pp = e->next;
+            diskBytes -= e->fileSize;
+            Free(e->key);
+            Free(e);
+        } else {
+            pp = &e->next;
+        }
+    }
+    diskEntry_t* e = Malloc(sizeof(diskEntry_t));
+    e->key = Malloc(strlen(key) + 1);
+    strcpy(e->key, key);
+    e->hash = hash;
+    e->fileSize = fileSize;
+    e->lastUse = lastUse;
+    e->pending = 0;
+    e->seq = 0;
+    e->next = buckets[hash % DISK_BUCKETS];
+    buckets[hash % DISK_BUCKETS] = e;
+    diskBytes += fileSize;
+    return e;
+}
+
+static diskEntry_t* findLocked(const char* key)
+{
+    uint64_t hash = hashKey(key);
+
+    for (diskEntry_t* e = buckets[hash % DISK_BUCKETS]; e != NULL; e = e->next) {
+        if (e->hash == hash && strcmp(e->key, key) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+/* Unlink an entry from the index and delete its file */
+static void removeLocked(diskEntry_t* e)
+{
+    char path[MAXLINE];
+    diskEntry_t** pp = &buckets[e->hash % DISK_BUCKETS];
+
+    while (*pp != e) {
+        pp = &(*pp)->next;
+    }
+    *pp = e->next;
+    filePath(path, sizeof(path), e->hash);
+    unlink(path); // 正在 mmap 的读者不受影响
+    diskBytes -= e->fileSize;
+    Free(e->key);
+    Free(e);
+}
+
+/* Evict least recently used files until need more bytes fit */
+static void evictLocked(size_t need)
+{
+    while (diskBytes + need > diskMax) {
+        diskEntry_t* victim = NULL;
+        for (int i = 0; i < DISK_BUCKETS; i++) {
+            for (diskEntry_t* e = buckets[i]; e != NULL; e = e->next) {
+                if (!e->pending && (victim == NULL || e->lastUse < victim->lastUse)) {
+                    victim = e;
+                }
+            }
+        }
+        if (victim == NULL) {
+            return;
+        }
+        removeLocked(victim);
+    }
+}
+
+static void filePath(char* path, size_t len, uint64_t hash)
+{
+    snprintf(path, len, "%s/%016llx", diskDir, (unsigned long long)hash);
+}
+
+/* FNV-1a, 64 bit */
+static uint64_t hashKey(const char* key)
+{
+    uint64_t h = 14695981039346656037ull;
+
+    while (*key) {
+        h = (h ^ (unsigned char)*key++) * 1099511628211ull;
+    }
+    return h;
+}
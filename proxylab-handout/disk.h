@@ -0,0 +1,27 @@
+/*
+ * disk.h - optional on-disk second tier behind the memory cache
+ */
+#ifndef __DISK_H__
+#define __DISK_H__
+
+#include "csapp.h"
+
+#define DISK_DEFAULT_MB 256     /* tier size when -D is given without -S */
+
+/* A cached object mapped from disk; release with diskClose() */
+typedef struct {
+    void* base;
+    size_t mapLen;
+    const char* data;           /* response bytes inside the mapping */
+    size_t size;
+    time_t fetched;             /* when the response came from the origin */
+} diskMap_t;
+
+void diskInit(const char* dir, size_t maxBytes);
+int diskOpen(const char* key, diskMap_t* m);
+void diskClose(diskMap_t* m);
+void diskStore(const char* key, const char* data, size_t size, time_t fetched);
+void diskRemove(const char* key);
+void diskRefresh(const char* key, const char* data, size_t size, time_t fetched);
+
+#endif /* __DISK_H__ */
@@ -0,0 +1,521 @@
+/*
+ * dns.c - hostname resolution cache and connect helper for the proxy
+ *
+ * getaddrinfo() answers are cached per host for DNS_TTL seconds, and
+ * failures for DNS_NEG_TTL seconds. Once an answer goes stale it is
+ * still served for up to DNS_STALE_TTL seconds while a background
+ * resolver thread refreshes it, so hot hosts never wait on DNS.
+ * Addresses are stored interleaved by family and dnsOpenClientfd()
+ * races them happy-eyeballs style: the next address is tried whenever
+ * the previous one has not connected within HAPPY_EYEBALLS_DELAY ms.
+ *
+ * dnsInit() can load an /etc/hosts style file whose entries never
+ * expire, which gives tests a resolver that does not touch the network.
+ *
+ * The event loop must not block in getaddrinfo(), so it uses
+ * dnsLookupNonblock(): a cold miss goes to the resolver thread too,
+ * which writes a byte to dnsNotifyFd() after every answer it stores.
+ *
+ * The table holds DNS_MAX_ENTRIES hosts. When it is full, entries past
+ * their stale window are dropped, or failing that the least recently
+ * used one.
+ */
+#include <poll.h>
+#include <limits.h>
+
+#include "csapp.h"
+#include "dns.h"
+
+#define DNS_BUCKETS 256
+#define DNS_MAX_ENTRIES 4096
+#define DNS_QUEUE_SIZE 64       /* pending background refreshes */
+
+typedef struct dnsEntry {
+    char* host;                 /* lower case */
+    dnsAddrs_t addrs;           /* n == 0 for a negative entry */
+    time_t expires;             /* fresh until, LONG_MAX for hosts file */
+    time_t lastUsed;            /* last lookup served from it, for eviction */
+    int refreshing;             /* queued for the resolver thread */
+    struct dnsEntry* next;
+} dnsEntry_t;
+
+static dnsEntry_t* buckets[DNS_BUCKETS];
+static int nEntries;
+static pthread_mutex_t dnsLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Hosts waiting for the resolver thread; the queue owns these copies */
+static char* queue[DNS_QUEUE_SIZE];
+static int qHead, qCount;
+static pthread_cond_t queueCond = PTHREAD_COND_INITIALIZER;
+static int notifyPipe[2];       /* resolver thread -> event loop */
+
+static void* resolverThread(void* vargp);
+static int resolve(const char* host, dnsAddrs_t* out);
+static void store(const char* host, const dnsAddrs_t* addrs, time_t expires);
+static int lookupLocked(dnsEntry_t* e, time_t now, dnsAddrs_t* out);
+static int enqueueLocked(dnsEntry_t* e);
+static dnsEntry_t* newEntryLocked(const char* host, time_t now);
+static dnsEntry_t* findLocked(const char* host);
+static void evictLocked(time_t now);
+static void loadHosts(const char* hostsFile);
+static void setPort(struct sockaddr_storage* sa, int port);
+static unsigned int hashHost(const char* host);
+static long nowMs(void);
+
+void dnsInit(const char* hostsFile)
+{
+    pthread_t tid;
+
+    if (hostsFile != NULL) {
+        loadHosts(hostsFile);
+    }
+    if (pipe(notifyPipe) < 0) {
+        unix_error("pipe error");
+    }
+    for (int i = 0; i < 2; i++) { // 管道满了也不阻塞解析线程
+        fcntl(notifyPipe[i], F_SETFL, fcntl(notifyPipe[i], F_GETFL) | O_NONBLOCK);
+        fcntl(notifyPipe[i], F_SETFD, FD_CLOEXEC);
+    }
+    Pthread_create(&tid, NULL, resolverThread, NULL);
+    Pthread_detach(tid);
+}
+
+/*
+ * dnsLookup - fill out with the addresses of host, port already set.
+ *     Returns 0 on success, -1 if the host does not resolve.
+ */
+int dnsLookup(const char* host, int port, dnsAddrs_t* out)
+{
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&dnsLock);
+    int found = lookupLocked(findLocked(host), now, out);
+    pthread_mutex_unlock(&dnsLock);
+
+    if (!found) {
+        resolve(host, out);
+        store(host, out, now + (out->n > 0 ? DNS_TTL : DNS_NEG_TTL));
+    }
+    if (out->n == 0) {
+        return -1;
+    }
+    for (int i = 0; i < out->n; i++) {
+        setPort(&out->addr[i], port);
+    }
+    return 0;
+}
+
+/*
+ * dnsLookupNonblock - dnsLookup() for the event loop. A cold miss is
+ *     handed to the resolver thread instead of blocking: returns 0 with
+ *     out filled, -1 if host does not resolve, or 1 if the answer is
+ *     pending, in which case dnsNotifyFd() turns readable once it is in.
+ */
+int dnsLookupNonblock(const char* host, int port, dnsAddrs_t* out)
+{
+    time_t now = time(NULL);
+    int pending = 0;
+
+    pthread_mutex_lock(&dnsLock);
+    dnsEntry_t* e = findLocked(host);
+    int found = lookupLocked(e, now, out);
+    if (!found && (e != NULL || (e = newEntryLocked(host, now)) != NULL)) {
+        pending = e->refreshing || enqueueLocked(e) == 0; // 同一主机只排队一次
+    }
+    pthread_mutex_unlock(&dnsLock);
+
+    if (!found && !pending) { // 表或队列满了, 只能当场解析
+        return dnsLookup(host, port, out);
+    }
+    if (pending) {
+        return 1;
+    }
+    if (out->n == 0) {
+        return -1;
+    }
+    for (int i = 0; i < out->n; i++) {
+        setPort(&out->addr[i], port);
+    }
+    return 0;
+}
+
+/* dnsNotifyFd - readable after the resolver thread stores an answer */
+int dnsNotifyFd(void)
+{
+    return notifyPipe[0];
+}
+
+/*
+ * dnsOpenClientfd - connect to host:port through the cache, racing the
+ *     addresses happy-eyeballs style, for at most timeoutMs in all.
+ *     Returns a blocking, connected descriptor, or -1 if every address
+ *     failed or the time ran out (errno ETIMEDOUT).
+ */
+int dnsOpenClientfd(const char* host, int port, int timeoutMs)
+{
+    long deadline = nowMs() + timeoutMs;
+    dnsAddrs_t addrs;
+    struct pollfd pfd[DNS_MAX_ADDRS];
+    int nPending = 0;
+    int next = 0;
+    int fd = -1;
+
+    if (dnsLookup(host, port, &addrs) < 0) {
+        return -1;
+    }
+
+    while (fd < 0 && (next < addrs.n || nPending > 0)) {
+        if (next < addrs.n) {
+            struct sockaddr_storage* sa = &addrs.addr[next];
+            int s = socket(sa->ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+            if (s >= 0) {
+                if (connect(s, (SA*)sa, addrs.len[next]) == 0) {
+                    fd = s;
+                    break;
+                }
+                if (errno == EINPROGRESS) {
+                    pfd[nPending].fd = s;
+                    pfd[nPending].events = POLLOUT;
+                    pfd[nPending].revents = 0;
+                    nPending++;
+                } else {
+                    close(s);
+                }
+            }
+            next++;
+        }
+        if (nPending == 0) {
+            continue;
+        }
+
+        /* Wait for any attempt; give up waiting early if more addresses remain */
+        long left = deadline - nowMs();
+        if (left <= 0) { // 连接超时
+            errno = ETIMEDOUT;
+            break;
+        }
+        if (next < addrs.n && left > HAPPY_EYEBALLS_DELAY) {
+            left = HAPPY_EYEBALLS_DELAY;
+        }
+        long waitUntil = nowMs() + left;
+        int rc;
+        while ((rc = poll(pfd, nPending, left)) < 0 && errno == EINTR) { // 被信号打断, 等完剩下的时间
+            left = waitUntil - nowMs() > 0 ? waitUntil - nowMs() : 0;
+        }
+        if (rc < 0) {
+            break;
+        }
+        for (int i = 0; i < nPending; i++) {
+            if (pfd[i].revents == 0) {
+                continue;
+            }
+            int err = 0;
+            socklen_t len = sizeof(err);
+            getsockopt(pfd[i].fd, SOL_SOCKET, SO_ERROR, &err, &len);
+            if (err == 0 && fd < 0) {
+                fd = pfd[i].fd;
+            } else {
+                close(pfd[i].fd);
+            }
+            pfd[i--] = pfd[--nPending];
+        }
+    }
+
+    for (int i = 0; i < nPending; i++) { // 输掉竞争的连接
+        close(pfd[i].fd);
+    }
+    if (fd >= 0) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    }
+    return fd;
+}
+
+/* Refresh stale entries off the request path */
+static void* resolverThread(void* vargp)
+{
+    dnsAddrs_t addrs;
+    char host[MAXLINE];
+
+    while (1) {
+        pthread_mutex_lock(&dnsLock);
+        while (qCount == 0) {
+            pthread_cond_wait(&queueCond, &dnsLock);
+        }
+        strncpy(host, queue[qHead], MAXLINE - 1);
+        host[MAXLINE - 1] = 0;
+        Free(queue[qHead]);
+        qHead = (qHead + 1) % DNS_QUEUE_SIZE;
+        qCount--;
+        pthread_mutex_unlock(&dnsLock);
+
+        if (resolve(host, &addrs) == 0) {
+            store(host, &addrs, time(NULL) + DNS_TTL);
+        } else {
+            pthread_mutex_lock(&dnsLock); // 刷新失败则继续用旧结果
+            dnsEntry_t* e = findLocked(host);
+            int stale = e != NULL && e->addrs.n > 0;
+            if (stale) {
+                e->refreshing = 0;
+            }
+            pthread_mutex_unlock(&dnsLock);
+            if (!stale) { // 冷启动的查询失败, 记下否定结果
+                store(host, &addrs, time(NULL) + DNS_NEG_TTL);
+            }
+        }
+        write(notifyPipe[1], "", 1); // 管道满时事件循环反正会被唤醒
+    }
+    return NULL;
+}
+
+/*
+ * resolve - getaddrinfo() host and store up to DNS_MAX_ADDRS addresses,
+ *     alternating families starting with the preferred one (RFC 8305).
+ *     Returns 0 on success, -1 (with out->n == 0) on failure.
+ */
+static int resolve(const char* host, dnsAddrs_t* out)
+{
+    struct addrinfo hints, *listp, *p;
+    struct addrinfo* byFamily[2][DNS_MAX_ADDRS];
+    int count[2] = { 0, 0 };
+    int rc;
+
+    out->n = 0;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_ADDRCONFIG;
+    if ((rc = getaddrinfo(host, NULL, &hints, &listp)) != 0) {
+        fprintf(stderr, "getaddrinfo failed (%s): %s\n", host, gai_strerror(rc));
+        return -1;
+    }
+
+    int first = listp->ai_family;
+    for (p = listp; p; p = p->ai_next) {
+        int f = p->ai_family != first;
+        if (count[f] < DNS_MAX_ADDRS && p->ai_addrlen <= sizeof(struct sockaddr_storage)) {
+            byFamily[f][count[f]++] = p;
+        }
+    }
+    for (int i = 0; out->n < DNS_MAX_ADDRS && (i < count[0] || i < count[1]); i++) {
+        for (int f = 0; f < 2 && out->n < DNS_MAX_ADDRS; f++) {
+            if (i < count[f]) {
+                memcpy(&out->addr[out->n], byFamily[f][i]->ai_addr, byFamily[f][i]->ai_addrlen);
+                out->len[out->n++] = byFamily[f][i]->ai_addrlen;
+            }
+        }
+    }
+    freeaddrinfo(listp);
+    return 0;
+}
+
+/* Insert or replace the entry for host */
+static void store(const char* host, const dnsAddrs_t* addrs, time_t expires)
+{
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&dnsLock);
+    dnsEntry_t* e = findLocked(host);
+    if (e == NULL && (e = newEntryLocked(host, now)) == NULL) { // 没有可以淘汰的条目
+        pthread_mutex_unlock(&dnsLock);
+        return;
+    }
+    if (e->expires != LONG_MAX) { // hosts 文件里的条目不被覆盖
+        e->addrs = *addrs;
+        e->expires = expires;
+    }
+    e->refreshing = 0;
+    pthread_mutex_unlock(&dnsLock);
+}
+
+/*
+ * lookupLocked - copy e's addresses to out if they may be served. A
+ *     stale answer is served while it is queued for a refresh.
+ */
+static int lookupLocked(dnsEntry_t* e, time_t now, dnsAddrs_t* out)
+{
+    if (e == NULL) {
+        return 0;
+    }
+    e->lastUsed = now;
+    if (now < e->expires) {
+        *out = e->addrs;
+        return 1;
+    }
+    if (e->addrs.n > 0 && now < e->expires + DNS_STALE_TTL) {
+        *out = e->addrs; // 先用旧的结果, 后台线程去刷新
+        if (!e->refreshing) {
+            enqueueLocked(e);
+        }
+        return 1;
+    }
+    return 0;
+}
+
+/* Queue e's host for the resolver thread; -1 if the queue is full */
+static int enqueueLocked(dnsEntry_t* e)
+{
+    if (qCount == DNS_QUEUE_SIZE) {
+        return -1;
+    }
+    char* host = Malloc(strlen(e->host) + 1);
+    strcpy(host, e->host);
+    queue[(qHead + qCount++) % DNS_QUEUE_SIZE] = host;
+    e->refreshing = 1;
+    pthread_cond_signal(&queueCond);
+    return 0;
+}
+
+/*
+ * newEntryLocked - add an empty, already expired entry for host, making
+ *     room if the table is full. NULL if nothing could be evicted.
+ */
+static dnsEntry_t* newEntryLocked(const char* host, time_t now)
+{
+    if (nEntries >= DNS_MAX_ENTRIES) {
+        evictLocked(now);
+    }
+    if (nEntries >= DNS_MAX_ENTRIES) {
+        return NULL;
+    }
+    unsigned int h = hashHost(host);
+    dnsEntry_t* e = Calloc(1, sizeof(dnsEntry_t));
+    e->lastUsed = now;
+    e->host = Malloc(strlen(host) + 1);
+    for (int i = 0; (e->host[i] = tolower((unsigned char)host[i])) != 0; i++) {
+        ;
+    }
+    e->next = buckets[h];
+    buckets[h] = e;
+    nEntries++;
+    return e;
+}
+
+static dnsEntry_t* findLocked(const char* host)
+{
+    for (dnsEntry_t* e = buckets[hashHost(host)]; e != NULL; e = e->next) {
+        if (strcasecmp(e->host, host) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * evictLocked - make room in a full table: drop every entry that can no
+ *     longer be served, or if there is none the least recently used.
+ *     Hosts file entries and ones being resolved are kept.
+ */
+static void evictLocked(time_t now)
+{
+    dnsEntry_t** lru = NULL;
+
+    for (int b = 0; b < DNS_BUCKETS; b++) {
+        for (dnsEntry_t** pp = &buckets[b]; *pp != NULL; ) {
+            dnsEntry_t* e = *pp;
+            if (e->expires == LONG_MAX || e->refreshing
+                || now < (e->addrs.n > 0 ? e->expires + DNS_STALE_TTL : e->expires)) {
+                pp = &e->next;
+                continue;
+            }
+            *pp = e->next;
+            Free(e->host);
+            Free(e);
+            nEntries--;
+        }
+    }
+    if (nEntries < DNS_MAX_ENTRIES) {
+        return;
+    }
+
+    for (int b = 0; b < DNS_BUCKETS; b++) {
+        for (dnsEntry_t** pp = &buckets[b]; *pp != NULL; pp = &(*pp)->next) {
+            dnsEntry_t* e = *pp;
+            if (e->expires != LONG_MAX && !e->refreshing
+                && (lru == NULL || e->lastUsed < (*lru)->lastUsed)) {
+                lru = pp;
+            }
+        }
+    }
+    if (lru != NULL) {
+        dnsEntry_t* e = *lru;
+        *lru = e->next;
+        Free(e->host);
+        Free(e);
+        nEntries--;
+    }
+}
+
+/* Load "address name [alias ...]" lines as entries that never expire */
+static void loadHosts(const char* hostsFile)
+{
+    FILE* fp = Fopen(hostsFile, "r");
+    char line[MAXLINE];
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        char* save;
+        char* hash = strchr(line, '#');
+        if (hash != NULL) {
+            *hash = 0;
+        }
+
+        char* ip = strtok_r(line, " \t\r\n", &save);
+        if (ip == NULL) {
+            continue;
+        }
+        dnsAddrs_t one;
+        memset(&one, 0, sizeof(one));
+        struct sockaddr_in* sin = (struct sockaddr_in*)&one.addr[0];
+        struct sockaddr_in6* sin6 = (struct sockaddr_in6*)&one.addr[0];
+        if (inet_pton(AF_INET, ip, &sin->sin_addr) == 1) {
+            sin->sin_family = AF_INET;
+            one.len[0] = sizeof(*sin);
+        } else if (inet_pton(AF_INET6, ip, &sin6->sin6_addr) == 1) {
+            sin6->sin6_family = AF_INET6;
+            one.len[0] = sizeof(*sin6);
+        } else {
+            continue;
+        }
+        one.n = 1;
+
+        char* name;
+        while ((name = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+            pthread_mutex_lock(&dnsLock);
+            dnsEntry_t* e = findLocked(name);
+            if (e != NULL && e->addrs.n < DNS_MAX_ADDRS) { // 同名多行则追加地址
+                e->addrs.addr[e->addrs.n] = one.addr[0];
+                e->addrs.len[e->addrs.n++] = one.len[0];
+            }
+            pthread_mutex_unlock(&dnsLock);
+            if (e == NULL) {
+                store(name, &one, LONG_MAX);
+            }
+        }
+    }
+    Fclose(fp);
+}
+
+static void setPort(struct sockaddr_storage* sa, int port)
+{
+    if (sa->ss_family == AF_INET6) {
+        ((struct sockaddr_in6*)sa)->sin6_port = htons(port);
+    } else {
+        ((struct sockaddr_in*)sa)->sin_port = htons(port);
+    }
+}
+
+static unsigned int hashHost(const char* host)
+{
+    unsigned int h = 5381;
+
+    while (*host) {
+        h = h * 33 + tolower((unsigned char)*host++);
+    }
+    return h % DNS_BUCKETS;
+}
+
+static long nowMs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
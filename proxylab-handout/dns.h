@@ -0,0 +1,28 @@
+/*
+ * dns.h - hostname resolution cache and connect helper for the proxy
+ */
+#ifndef __DNS_H__
+#define __DNS_H__
+
+#include "csapp.h"
+
+#define DNS_MAX_ADDRS 8         /* addresses kept per host */
+#define DNS_TTL 60              /* seconds a positive answer is fresh */
+#define DNS_STALE_TTL 300       /* seconds a stale answer may still be served */
+#define DNS_NEG_TTL 5           /* seconds a failed lookup is remembered */
+#define HAPPY_EYEBALLS_DELAY 250 /* ms before racing the next address */
+
+/* Resolved addresses, ordered for happy-eyeballs connects */
+typedef struct {
+    int n;
+    struct sockaddr_storage addr[DNS_MAX_ADDRS];
+    socklen_t len[DNS_MAX_ADDRS];
+} dnsAddrs_t;
+
+void dnsInit(const char* hostsFile);
+int dnsLookup(const char* host, int port, dnsAddrs_t* out);
+int dnsLookupNonblock(const char* host, int port, dnsAddrs_t* out);
+int dnsNotifyFd(void);
+int dnsOpenClientfd(const char* host, int port, int timeoutMs);
+
+#endif /* __DNS_H__ */
@@ -0,0 +1,1030 @@
+/*
+ * evloop.c - single-threaded, event-driven proxy engine (proxy -e)
+ *
+ * Every client/server pair is an evConn that moves through
+ *
+ *     READ_REQUEST -> [RESOLVE ->] CONNECT -> WRITE_REQUEST -> RELAY
+ *
+ * or READ_REQUEST -> SEND_CACHED on a cache hit, and back to
+ * READ_REQUEST when the client keeps the connection open. A stale copy
+ * is revalidated with a conditional request, and a 304 in RELAY sends
+ * the renewed copy from SEND_CACHED. All descriptors are
+ * non-blocking and only the side the current state is waiting on is
+ * registered with epoll, so an idle connection costs one small evConn
+ * and no thread stack. Buffers are allocated when a state needs them.
+ * A host missing from the DNS cache is resolved by dns.c's resolver
+ * thread while the pair waits in RESOLVE, watching nothing.
+ *
+ * Every live evConn is also on a list that is swept about once a second;
+ * a pair that has waited longer than the timeout for its state (-c, -r,
+ * -w) is answered with 504 if nothing was relayed yet, or closed. A
+ * client idle between requests gets KEEPALIVE_TIMEOUT.
+ */
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#include "csapp.h"
+#include "cache.h"
+#include "proxy.h"
+#include "dns.h"
+#include "stats.h"
+#include "relay.h"
+
+#define MAX_EVENTS 256
+#define REQ_INITSIZE 512   /* request head buffer grows up to MAX_REQ_HEADER */
+#define SWEEP_INTERVAL 1000 /* ms between idle sweeps */
+
+enum { READ_REQUEST, RESOLVE, CONNECT, WRITE_REQUEST, RELAY, SEND_CACHED };
+
+typedef struct evConn evConn_t;
+
+/* One side of a connection pair; epoll_event.data.ptr points here */
+typedef struct {
+    evConn_t* conn;
+    int fd;                     /* -1 when not open */
+    unsigned int events;        /* events registered with epoll, 0 if none */
+} evEnd_t;
+
+struct evConn {
+    int state;
+    int dead;                   /* closed, freed after the current batch */
+    evEnd_t client;
+    evEnd_t server;
+
+    char* req;                  /* request head read from client, and any pipelined after it */
+    size_t reqLen;
+    size_t reqSize;
+    http_req_t head;            /* parse of req so far */
+    size_t headLen;             /* length of the parsed head */
+    int keep;                   /* client connection outlives this response */
+    int served;                 /* responses finished on this connection */
+
+    char* out;                  /* bytes being written by WRITE_REQUEST/SEND_CACHED */
+    size_t outLen;
+    size_t outOff;
+    cacheObj_t* obj;            /* cached object out points into */
+    cacheObj_t* stale;          /* cached copy the request revalidates, or NULL */
+    struct iovec iov[3];        /* SEND_CACHED: out, split to add our Connection line */
+    int iovIdx;
+    int iovCnt;
+
+    long lastActive;            /* last event on either side, for the sweep */
+    long start;                 /* request line seen, for statsLatency */
+    long fetchStart;            /* upstream lookup started, for statsTtfb */
+    size_t relayed;             /* response bytes read from the server */
+
+    char* host;                 /* origin being resolved, and its port */
+    int port;
+    dnsAddrs_t* addrs;          /* connect candidates */
+    int addr;                   /* index of the candidate being tried */
+
+    char* buf;                  /* server -> client relay buffer */
+    size_t bufLen;
+    size_t bufOff;
+    size_t bufSize;
+    int gotHead;                /* response head rewritten and queued for the client */
+    size_t headSize;            /* the rewritten head as kept in the tee */
+    long bodyLeft;              /* body bytes still due, -1 if it runs to EOF */
+    int done;                   /* whole response read from the server */
+
+    char* key;                  /* cache key, NULL if not cacheable */
+    tee_t tee;                  /* copy of the response for the cache */
+
+    evConn_t* prev;             /* live list, while not dead */
+    evConn_t* next;
+    evConn_t* nextDead;
+};
+
+static int epFd;
+static evConn_t* liveList;
+static evConn_t* deadList;
+static long loopNow;            /* statsNow() after the last epoll_wait */
+static evEnd_t resolverEnd;     /* epoll data for dnsNotifyFd() */
+static int acceptPaused;        /* listen fd left out of epoll until the next sweep */
+
+static void acceptAll(int listenFd);
+static void watchListen(int listenFd);
+static void onClientReadable(evConn_t* c);
+static void onClientWritable(evConn_t* c);
+static void onServerWritable(evConn_t* c);
+static void onServerReadable(evConn_t* c);
+static void handleRequest(evConn_t* c);
+static void resolveHost(evConn_t* c);
+static void resumeResolving(void);
+static void tryConnect(evConn_t* c);
+static void readHead(evConn_t* c);
+static void relayHead(evConn_t* c, size_t headLen);
+static void confirmStale(evConn_t* c, size_t headLen);
+static void completeResponse(evConn_t* c);
+static void pushRelay(evConn_t* c);
+static void sendCached(evConn_t* c);
+static void sendOut(evConn_t* c, size_t hdrEnd);
+static void nextRequest(evConn_t* c);
+static int flushRelay(evConn_t* c);
+static void teeObject(evConn_t* c, const char* data, size_t n);
+static void replyError(evConn_t* c, const char* status);
+static void sweepIdle(void);
+static void watch(evEnd_t* end, unsigned int events);
+static void closeConn(evConn_t* c);
+
+/*
+ * eventLoop - serve every connection accepted on listenFd from this
+ *     thread. Never returns.
+ */
+void eventLoop(int listenFd)
+{
+    struct epoll_event events[MAX_EVENTS];
+    struct rlimit rl;
+
+    /* Each connection pair needs two descriptors */
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    if ((epFd = epoll_create1(0)) < 0) {
+        unix_error("epoll_create1 error");
+    }
+    fcntl(listenFd, F_SETFL, fcntl(listenFd, F_GETFL) | O_NONBLOCK);
+    watchListen(listenFd);
+    resolverEnd.fd = dnsNotifyFd();
+    watch(&resolverEnd, EPOLLIN);
+
+    long lastSweep = statsNow();
+    while (1) {
+        int n = epoll_wait(epFd, events, MAX_EVENTS, SWEEP_INTERVAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            unix_error("epoll_wait error");
+        }
+        loopNow = statsNow();
+
+        for (int i = 0; i < n; i++) {
+            evEnd_t* end = events[i].data.ptr;
+            if (end == NULL) {
+                acceptAll(listenFd);
+                continue;
+            }
+            if (end == &resolverEnd) {
+                resumeResolving();
+                continue;
+            }
+
+            evConn_t* c = end->conn;
+            if (c->dead) { // 同一批事件中连接已被关闭
+                continue;
+            }
+            c->lastActive = loopNow;
+            if (end == &c->client) {
+                if (c->state == READ_REQUEST) {
+                    onClientReadable(c);
+                } else {
+                    onClientWritable(c);
+                }
+            } else {
+                if (c->state == RELAY) {
+                    onServerReadable(c);
+                } else {
+                    onServerWritable(c);
+                }
+            }
+        }
+
+        if (loopNow - lastSweep >= SWEEP_INTERVAL * 1000L) {
+            sweepIdle();
+            lastSweep = loopNow;
+            if (acceptPaused) {
+                watchListen(listenFd);
+            }
+        }
+        while (deadList != NULL) {
+            evConn_t* c = deadList;
+            deadList = c->nextDead;
+            Free(c);
+        }
+    }
+}
+
+/*
+ * acceptAll - accept every pending connection. Out of descriptors the
+ *     pending ones stay queued and the level-triggered listen fd would
+ *     wake the loop at once, so it leaves epoll until the next sweep.
+ */
+static void acceptAll(int listenFd)
+{
+    struct sockaddr_storage clientAddr;
+    socklen_t clientLen;
+    int connFd;
+
+    while (1) {
+        clientLen = sizeof(clientAddr);
+        connFd = accept(listenFd, (SA*)&clientAddr, &clientLen);
+        if (connFd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                fprintf(stderr, "accept error: %s\n", strerror(errno));
+            }
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                epoll_ctl(epFd, EPOLL_CTL_DEL, listenFd, NULL);
+                acceptPaused = 1;
+            }
+            return;
+        }
+        fcntl(connFd, F_SETFL, fcntl(connFd, F_GETFL) | O_NONBLOCK);
+
+        evConn_t* c = Calloc(1, sizeof(evConn_t));
+        c->state = READ_REQUEST;
+        c->client.conn = c->server.conn = c;
+        c->client.fd = connFd;
+        c->server.fd = -1;
+        c->reqSize = REQ_INITSIZE;
+        c->req = Malloc(c->reqSize);
+        http_init(&c->head);
+        c->lastActive = statsNow();
+        if ((c->next = liveList) != NULL) {
+            liveList->prev = c;
+        }
+        liveList = c;
+        if (limits.maxInflight > 0) { // 限制慢速 client 在内核中占用的缓冲
+            int sndBuf = limits.maxInflight;
+            setsockopt(connFd, SOL_SOCKET, SO_SNDBUF, &sndBuf, sizeof(sndBuf));
+        }
+        watch(&c->client, EPOLLIN);
+    }
+}
+
+/* (Re)add the listen fd to epoll; its data.ptr is NULL */
+static void watchListen(int listenFd)
+{
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL; // NULL 表示监听描述符
+    if (epoll_ctl(epFd, EPOLL_CTL_ADD, listenFd, &ev) < 0) {
+        unix_error("epoll_ctl error");
+    }
+    acceptPaused = 0;
+}
+
+/*
+ * READ_REQUEST: collect the request head up to the blank line. A
+ * pipelined request may already be in req, so parse before reading.
+ */
+static void onClientReadable(evConn_t* c)
+{
+    while (1) {
+        int rc = http_parse_request(&c->head, c->req, c->reqLen); // 从上次停下的行继续
+        if (rc == HTTP_BAD) {
+            replyError(c, "400 Bad Request");
+            return;
+        }
+        if (rc == HTTP_NOMEM) {
+            replyError(c, "431 Request Header Fields Too Large");
+            return;
+        }
+        if (rc > 0) {
+            c->headLen = rc;
+            handleRequest(c);
+            return;
+        }
+
+        if (c->reqLen == c->reqSize - 1) {
+            if (c->reqSize == MAX_REQ_HEADER) { // 请求头过长, 与多线程路径同一上限
+                replyError(c, "431 Request Header Fields Too Large");
+                return;
+            }
+            c->reqSize = c->reqSize * 2 > MAX_REQ_HEADER ? MAX_REQ_HEADER : c->reqSize * 2;
+            c->req = Realloc(c->req, c->reqSize);
+        }
+
+        ssize_t n = read(c->client.fd, c->req + c->reqLen, c->reqSize - 1 - c->reqLen);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (n <= 0) {
+            closeConn(c);
+            return;
+        }
+        c->reqLen += n;
+    }
+}
+
+static void handleRequest(evConn_t* c)
+{
+    const char* method = http_span_str(c->req, c->head.method);
+    const char* url = http_span_str(c->req, c->head.uri);
+    char host[MAXLINE];
+    char position[MAXLINE];
+    int port;
+
+    if (strcmp(method, "GET") != 0) {
+        replyError(c, "501 Not Implemented");
+        return;
+    }
+    if (strcmp(url, STATS_URL) == 0) { // 代理自身的统计页面, 与缓存命中走同一条路径
+        watch(&c->client, 0);
+        c->out = statsResponse(&c->outLen);
+        c->keep = 0;
+        sendOut(c, 0);
+        return;
+    }
+
+    c->start = statsNow();
+    statsAdd(STAT_REQUESTS, 1);
+    if (parseUrl(url, host, position, &port) < 0) {
+        replyError(c, "400 Bad Request");
+        return;
+    }
+
+    httpHeader_t httpHeader;
+    reqInfo_t info;
+    info.http11 = c->head.minor == 1;
+    info.pooled = 0;
+    if (buildHttpHeader(&httpHeader, host, position, c->req, &c->head, &info) < 0) {
+        replyError(c, "431 Request Header Fields Too Large");
+        return;
+    }
+    if (info.chunked || info.contentLength > 0) { // 不转发请求体, 直接拒绝, 免得 server 等一个不会来的 body
+        freeHttpHeader(&httpHeader);
+        replyError(c, info.chunked ? "411 Length Required" : "413 Payload Too Large");
+        return;
+    }
+    c->keep = info.keepAlive;
+
+    /* The head is copied out; keep only what the client sent after it */
+    c->reqLen -= c->headLen;
+    memmove(c->req, c->req + c->headLen, c->reqLen);
+    http_free(&c->head);
+    http_init(&c->head);
+    watch(&c->client, 0);
+
+    char key[MAXLINE];
+    cacheKey(key, sizeof(key), host, port, position);
+    if ((c->obj = cacheLookup(key)) != NULL && !cacheFresh(c->obj)) { // 过期的对象先向 server 验证, 同 freshLookup
+        if (!info.conditional && (c->obj->etag != NULL || c->obj->lastModified != NULL)) {
+            c->stale = c->obj;
+        } else {
+            cacheRelease(c->obj);
+        }
+        c->obj = NULL;
+    }
+    if (c->obj != NULL) {
+        freeHttpHeader(&httpHeader);
+        statsAdd(STAT_CACHE_HITS, 1);
+        sendCached(c);
+        return;
+    }
+    statsAdd(STAT_CACHE_MISSES, 1);
+    if (c->stale != NULL) {
+        setConditional(&httpHeader, c->stale->etag, c->stale->etagLen,
+                       c->stale->lastModified, c->stale->lastModifiedLen);
+    }
+    c->key = Malloc(strlen(key) + 1);
+    strcpy(c->key, key);
+    teeInit(&c->tee, MAX_OBJECT_SIZE);
+    c->out = flattenHttpHeader(&httpHeader, &c->outLen);
+    freeHttpHeader(&httpHeader);
+
+    c->fetchStart = statsNow();
+    c->addrs = Malloc(sizeof(dnsAddrs_t));
+    c->host = Malloc(strlen(host) + 1);
+    strcpy(c->host, host);
+    c->port = port;
+    resolveHost(c);
+}
+
+/* Connect once c->host resolves; a cold miss parks the pair in RESOLVE */
+static void resolveHost(evConn_t* c)
+{
+    int rc = dnsLookupNonblock(c->host, c->port, c->addrs);
+    if (rc > 0) {
+        c->state = RESOLVE;
+        return;
+    }
+    Free(c->host);
+    c->host = NULL;
+    if (rc < 0) {
+        statsAdd(STAT_CONNECT_FAILURES, 1);
+        replyError(c, "502 Bad Gateway");
+        return;
+    }
+    c->addr = 0;
+    tryConnect(c);
+}
+
+/* The resolver thread stored answers: retry every pair waiting on one */
+static void resumeResolving(void)
+{
+    char drain[256];
+    evConn_t* next;
+
+    while (read(resolverEnd.fd, drain, sizeof(drain)) > 0) {
+        ;
+    }
+    for (evConn_t* c = liveList; c != NULL; c = next) {
+        next = c->next;
+        if (c->state == RESOLVE) {
+            resolveHost(c);
+        }
+    }
+}
+
+/* Start a non-blocking connect to the next candidate address */
+static void tryConnect(evConn_t* c)
+{
+    for (; c->addr < c->addrs->n; c->addr++) {
+        struct sockaddr_storage* sa = &c->addrs->addr[c->addr];
+        int fd = socket(sa->ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (fd < 0) {
+            continue;
+        }
+        c->server.fd = fd;
+        if (connect(fd, (SA*)sa, c->addrs->len[c->addr]) == 0) {
+            c->state = WRITE_REQUEST;
+            watch(&c->server, EPOLLOUT);
+            return;
+        }
+        if (errno == EINPROGRESS) {
+            c->state = CONNECT;
+            watch(&c->server, EPOLLOUT);
+            return;
+        }
+        close(fd);
+        c->server.fd = -1;
+    }
+    statsAdd(STAT_CONNECT_FAILURES, 1);
+    replyError(c, "502 Bad Gateway"); // 所有地址都连接失败
+}
+
+/* CONNECT and WRITE_REQUEST */
+static void onServerWritable(evConn_t* c)
+{
+    if (c->state == CONNECT) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(c->server.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err != 0) {
+            watch(&c->server, 0);
+            close(c->server.fd);
+            c->server.fd = -1;
+            c->addr++;
+            tryConnect(c);
+            return;
+        }
+        c->state = WRITE_REQUEST;
+    }
+
+    while (c->outOff < c->outLen) {
+        ssize_t n = write(c->server.fd, c->out + c->outOff, c->outLen - c->outOff);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (n < 0) {
+            closeConn(c);
+            return;
+        }
+        c->outOff += n;
+    }
+
+    Free(c->out);
+    c->out = NULL;
+    Free(c->addrs);
+    c->addrs = NULL;
+    c->buf = Malloc(MAXBUF);
+    c->bufSize = MAXBUF;
+    c->bufLen = c->bufOff = 0;
+    c->state = RELAY;
+    watch(&c->server, EPOLLIN);
+}
+
+/* RELAY: pull a buffer from the server and push it to the client */
+static void onServerReadable(evConn_t* c)
+{
+    if (!c->gotHead) {
+        readHead(c);
+        return;
+    }
+
+    ssize_t n = read(c->server.fd, c->buf, c->bufSize);
+    if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return;
+    }
+    if (n == 0 && c->bodyLeft < 0) { // 没有长度的 body 在 server 关闭时结束
+        completeResponse(c);
+        pushRelay(c);
+        return;
+    }
+    if (n <= 0) { // 出错或 body 不完整, 不能缓存
+        closeConn(c);
+        return;
+    }
+
+    if (c->bodyLeft >= 0 && n > c->bodyLeft) { // server 多发的数据不转发
+        n = c->bodyLeft;
+    }
+    c->relayed += n;
+    statsAdd(STAT_BYTES_IN, n);
+    teeObject(c, c->buf, n);
+    c->bufLen = n;
+    c->bufOff = 0;
+    if (c->bodyLeft > 0 && (c->bodyLeft -= n) == 0) {
+        completeResponse(c);
+    }
+    pushRelay(c);
+}
+
+/* RELAY, until the response head is in: collect it in buf */
+static void readHead(evConn_t* c)
+{
+    while (1) {
+        if (c->bufLen == c->bufSize) {
+            if (c->bufSize >= MAX_OBJECT_SIZE) { // 响应头过长, 与多线程路径同一上限
+                replyError(c, "502 Bad Gateway");
+                return;
+            }
+            c->bufSize *= 2;
+            c->buf = Realloc(c->buf, c->bufSize);
+        }
+
+        ssize_t n = read(c->server.fd, c->buf + c->bufLen, c->bufSize - c->bufLen);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (n <= 0) { // 响应头不完整, client 还什么都没收到
+            replyError(c, "502 Bad Gateway");
+            return;
+        }
+
+        if (c->relayed == 0) {
+            statsTtfb(c->fetchStart);
+        }
+        c->relayed += n;
+        statsAdd(STAT_BYTES_IN, n);
+
+        /* Look for the blank line only in what is new, plus 3 bytes */
+        size_t from = c->bufLen > 3 ? c->bufLen - 3 : 0;
+        c->bufLen += n;
+        for (char* p = c->buf + from; (p = memchr(p, '\r', c->buf + c->bufLen - p)) != NULL; p++) {
+            if (c->buf + c->bufLen - p >= 4 && memcmp(p, "\r\n\r\n", 4) == 0) {
+                relayHead(c, p + 4 - c->buf);
+                return;
+            }
+        }
+    }
+}
+
+/*
+ * relayHead - rewrite the response head in buf[0, headLen) as
+ *     relayResponse() does: hop-by-hop headers are dropped, the tee
+ *     keeps the status line and end-to-end headers, and the client gets
+ *     them with our own Connection line, followed by any body bytes
+ *     that were read along with the head
+ */
+static void relayHead(evConn_t* c, size_t headLen)
+{
+    const char* connLine = "Connection: keep-alive\r\n\r\n";
+    size_t connLen = strlen(connLine);
+    size_t rest = c->bufLen - headLen;
+    size_t size = headLen + connLen + rest > MAXBUF ? headLen + connLen + rest : MAXBUF;
+    char* out;
+    size_t len = 0;
+    int minor = 0;
+    int status = 0;
+    int chunked = 0;
+    long contentLength = -1;
+
+    sscanf(c->buf, "HTTP/1.%d %d", &minor, &status);
+    if (c->stale != NULL && status == 304) { // 缓存的副本仍然有效, 不用重传 body
+        confirmStale(c, headLen);
+        return;
+    }
+    out = Malloc(size);
+    for (char* line = c->buf; line < c->buf + headLen - 2; ) {
+        char* eol = (char*)memchr(line, '\n', c->buf + headLen - line) + 1;
+        if (strncasecmp(line, "Connection:", 11) != 0 && strncasecmp(line, "Proxy-Connection:", 17) != 0
+            && strncasecmp(line, "Keep-Alive:", 11) != 0) {
+            if (strncasecmp(line, "Content-Length:", 15) == 0) {
+                contentLength = strtol(line + 15, NULL, 10);
+            }
+            if (strncasecmp(line, "Transfer-Encoding:", 18) == 0) {
+                chunked = 1;
+            }
+            memcpy(out + len, line, eol - line);
+            len += eol - line;
+        }
+        line = eol;
+    }
+    memcpy(out + len, "\r\n", 2);
+    c->headSize = len + 2;
+    if (chunked && c->key != NULL) { // 分块编码的响应只转发, 不缓存
+        Free(c->key);
+        c->key = NULL;
+    }
+    teeObject(c, out, c->headSize);
+
+    /* Without a length the body ends when the server closes, and so must the client connection */
+    if (status / 100 == 1 || status == 204 || status == 304) {
+        c->bodyLeft = 0;
+    } else {
+        c->bodyLeft = chunked ? -1 : contentLength;
+    }
+    if (c->bodyLeft < 0) {
+        c->keep = 0;
+    }
+    if (!c->keep) {
+        connLine = "Connection: close\r\n\r\n";
+        connLen = strlen(connLine);
+    }
+    memcpy(out + len, connLine, connLen);
+    len += connLen;
+    if (c->bodyLeft >= 0 && rest > c->bodyLeft) {
+        rest = c->bodyLeft;
+    }
+    memcpy(out + len, c->buf + headLen, rest);
+    teeObject(c, c->buf + headLen, rest);
+    Free(c->buf);
+    c->buf = out;
+    c->bufSize = size;
+    c->bufLen = len + rest;
+    c->bufOff = 0;
+    c->gotHead = 1;
+    if (c->bodyLeft > 0) {
+        c->bodyLeft -= rest;
+    }
+    if (c->bodyLeft == 0) {
+        completeResponse(c);
+    }
+    pushRelay(c);
+}
+
+/*
+ * confirmStale - the server answered the revalidation of c->stale with
+ *     the 304 head in buf[0, headLen): renew the cached copy and send
+ *     it, as relayResponse() does
+ */
+static void confirmStale(evConn_t* c, size_t headLen)
+{
+    cacheRefresh(c->stale, c->buf, headLen);
+    statsAdd(STAT_REVALIDATED, 1);
+    watch(&c->server, 0);
+    close(c->server.fd);
+    c->server.fd = -1;
+    Free(c->buf);
+    c->buf = NULL;
+    c->bufLen = c->bufOff = c->bufSize = 0;
+    if (c->key != NULL) {
+        Free(c->key);
+        c->key = NULL;
+    }
+    teeAbandon(&c->tee);
+    c->obj = c->stale;
+    c->stale = NULL;
+    sendCached(c);
+}
+
+/*
+ * completeResponse - the server has sent all of the response: cache the
+ *     copy if it is still whole and let the server connection go
+ */
+static void completeResponse(evConn_t* c)
+{
+    if (c->key != NULL) {
+        if (c->bodyLeft < 0) {
+            insertUnframed(c->key, c->tee.buf, c->headSize, c->tee.size - c->headSize);
+        } else {
+            cacheInsert(c->key, c->tee.buf, c->tee.size);
+        }
+    }
+    watch(&c->server, 0);
+    close(c->server.fd);
+    c->server.fd = -1;
+    c->done = 1;
+}
+
+/*
+ * pushRelay - write what the relay buffer holds to the client, and
+ *     read the server again once it is out, or finish the response
+ */
+static void pushRelay(evConn_t* c)
+{
+    int rc = flushRelay(c);
+    if (rc == 1 && c->done) {
+        statsLatency(c->start);
+        nextRequest(c);
+    } else if (rc == 1) {
+        watch(&c->client, 0);
+        watch(&c->server, EPOLLIN);
+    } else if (rc == 0) {
+        watch(&c->server, 0); // client 写不动了, 暂停读 server
+        watch(&c->client, EPOLLOUT);
+    }
+}
+
+/* RELAY and SEND_CACHED */
+static void onClientWritable(evConn_t* c)
+{
+    if (c->state == SEND_CACHED) {
+        while (c->iovIdx < c->iovCnt) {
+            ssize_t n = writev(c->client.fd, c->iov + c->iovIdx, c->iovCnt - c->iovIdx);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return;
+            }
+            if (n < 0) {
+                c->keep = 0;
+                break;
+            }
+            c->outOff += n;
+            for (; c->iovIdx < c->iovCnt && (size_t)n >= c->iov[c->iovIdx].iov_len; c->iovIdx++) {
+                n -= c->iov[c->iovIdx].iov_len;
+            }
+            if (n > 0) { // 写了一部分的 iovec
+                c->iov[c->iovIdx].iov_base = (char*)c->iov[c->iovIdx].iov_base + n;
+                c->iov[c->iovIdx].iov_len -= n;
+            }
+        }
+        if (c->obj != NULL) {
+            statsAdd(STAT_BYTES_OUT, c->outOff);
+            statsLatency(c->start);
+        }
+        nextRequest(c);
+        return;
+    }
+
+    pushRelay(c);
+}
+
+/* SEND_CACHED: send c->obj with our Connection line */
+static void sendCached(evConn_t* c)
+{
+    size_t hdrEnd = 0;
+
+    c->out = c->obj->data;
+    c->outLen = c->obj->size;
+    while (hdrEnd + 4 <= c->outLen && memcmp(c->out + hdrEnd, "\r\n\r\n", 4) != 0) {
+        hdrEnd++;
+    }
+    if (hdrEnd + 4 > c->outLen) { // 没有完整的头部, 原样发送后关闭
+        c->keep = 0;
+        hdrEnd = 0;
+    } else {
+        hdrEnd += 2; // 保留最后一个头部行的 CRLF
+    }
+    sendOut(c, hdrEnd);
+}
+
+/*
+ * sendOut - queue out for the client in SEND_CACHED. With hdrEnd (the
+ *     end of the last header line) our Connection line goes in there,
+ *     as sendCached() does; error and stats responses carry their own.
+ */
+static void sendOut(evConn_t* c, size_t hdrEnd)
+{
+    const char* connLine = c->keep ? "Connection: keep-alive\r\n" : "Connection: close\r\n";
+
+    c->iov[0].iov_base = c->out;
+    c->iov[0].iov_len = hdrEnd > 0 ? hdrEnd : c->outLen;
+    c->iovCnt = 1;
+    if (hdrEnd > 0) {
+        c->iov[1].iov_base = (void*)connLine;
+        c->iov[1].iov_len = strlen(connLine);
+        c->iov[2].iov_base = c->out + hdrEnd;
+        c->iov[2].iov_len = c->outLen - hdrEnd;
+        c->iovCnt = 3;
+    }
+    c->iovIdx = 0;
+    c->outOff = 0;
+    c->state = SEND_CACHED;
+    watch(&c->client, EPOLLOUT);
+}
+
+/*
+ * nextRequest - the response is out: close the pair, or drop what it
+ *     held and wait for the client's next request
+ */
+static void nextRequest(evConn_t* c)
+{
+    if (!c->keep) {
+        closeConn(c);
+        return;
+    }
+    if (c->obj != NULL) {
+        cacheRelease(c->obj);
+        c->obj = NULL;
+    } else if (c->out != NULL) {
+        Free(c->out);
+    }
+    if (c->stale != NULL) {
+        cacheRelease(c->stale);
+        c->stale = NULL;
+    }
+    c->out = NULL;
+    c->outLen = c->outOff = 0;
+    if (c->buf != NULL) {
+        Free(c->buf);
+        c->buf = NULL;
+    }
+    c->bufLen = c->bufOff = c->bufSize = 0;
+    if (c->key != NULL) {
+        Free(c->key);
+        c->key = NULL;
+    }
+    teeAbandon(&c->tee);
+    c->gotHead = c->done = 0;
+    c->headSize = 0;
+    c->bodyLeft = 0;
+    c->relayed = 0;
+    c->served++;
+
+    c->state = READ_REQUEST;
+    watch(&c->client, EPOLLIN);
+    onClientReadable(c); // 可能已经收到了流水线上的下一个请求
+}
+
+/*
+ * flushRelay - write the pending relay buffer to the client.
+ *     Returns 1 when it is empty, 0 if the client would block and -1
+ *     (after closing the pair) on error.
+ */
+static int flushRelay(evConn_t* c)
+{
+    while (c->bufOff < c->bufLen) {
+        ssize_t n = write(c->client.fd, c->buf + c->bufOff, c->bufLen - c->bufOff);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        if (n < 0) {
+            closeConn(c);
+            return -1;
+        }
+        c->bufOff += n;
+        statsAdd(STAT_BYTES_OUT, n);
+    }
+    return 1;
+}
+
+/* Keep a copy of a 200 response while it fits in MAX_OBJECT_SIZE */
+static void teeObject(evConn_t* c, const char* data, size_t n)
+{
+    if (c->key == NULL) {
+        return;
+    }
+    if ((c->tee.size == 0 && (n < 13 || memcmp(data + 8, " 200 ", 5) != 0))
+        || !teeAppend(&c->tee, data, n)) {
+        Free(c->key); // 不可缓存, 之后只转发
+        c->key = NULL;
+        teeAbandon(&c->tee);
+    }
+}
+
+/*
+ * replyError - drop whatever the pair was doing upstream and send the
+ *     client a short error response, then close
+ */
+static void replyError(evConn_t* c, const char* status)
+{
+    watch(&c->client, 0);
+    if (c->server.fd >= 0) {
+        close(c->server.fd);
+        c->server.fd = -1;
+        c->server.events = 0;
+    }
+    if (c->obj != NULL) {
+        cacheRelease(c->obj);
+        c->obj = NULL;
+    } else if (c->out != NULL) {
+        Free(c->out);
+    }
+    c->out = errorResponse(status, &c->outLen);
+    c->keep = 0;
+    sendOut(c, 0);
+}
+
+/*
+ * sweepIdle - time out pairs that have waited too long for the event
+ *     their state needs
+ */
+static void sweepIdle(void)
+{
+    evConn_t* next;
+
+    for (evConn_t* c = liveList; c != NULL; c = next) {
+        next = c->next;
+        int limit;
+        switch (c->state) {
+        case RESOLVE:
+        case CONNECT:
+            limit = limits.connect;
+            break;
+        case RELAY: // 等待 client 可写时按写超时, 否则按读超时
+            limit = c->client.events != 0 ? limits.write : limits.read;
+            break;
+        case READ_REQUEST: // 两个请求之间的空闲连接按 keep-alive 超时
+            limit = c->served > 0 && c->reqLen == 0 ? KEEPALIVE_TIMEOUT : limits.read;
+            break;
+        default:
+            limit = limits.write;
+            break;
+        }
+        if (loopNow - c->lastActive < limit * 1000000L) {
+            continue;
+        }
+
+        c->lastActive = loopNow;
+        if (c->state == RESOLVE || c->state == CONNECT) {
+            statsAdd(STAT_CONNECT_FAILURES, 1);
+        }
+        if (c->state == RESOLVE || c->state == CONNECT || c->state == WRITE_REQUEST
+            || (c->state == RELAY && !c->gotHead)) {
+            replyError(c, "504 Gateway Timeout");
+        } else {
+            closeConn(c);
+        }
+    }
+}
+
+/* Change the epoll interest set of one side of a pair */
+static void watch(evEnd_t* end, unsigned int events)
+{
+    struct epoll_event ev;
+    int op;
+
+    if (end->events == events) {
+        return;
+    }
+    if (end->events == 0) {
+        op = EPOLL_CTL_ADD;
+    } else if (events == 0) {
+        op = EPOLL_CTL_DEL;
+    } else {
+        op = EPOLL_CTL_MOD;
+    }
+    ev.events = events;
+    ev.data.ptr = end;
+    if (epoll_ctl(epFd, op, end->fd, &ev) < 0) {
+        unix_error("epoll_ctl error");
+    }
+    end->events = events;
+}
+
+/* Close both sides; the evConn itself is freed after the current batch */
+static void closeConn(evConn_t* c)
+{
+    if (c->client.fd >= 0) {
+        close(c->client.fd); // close 会自动从 epoll 中移除
+    }
+    if (c->server.fd >= 0) {
+        close(c->server.fd);
+    }
+    if (c->obj != NULL) {
+        cacheRelease(c->obj);
+    } else if (c->out != NULL) {
+        Free(c->out);
+    }
+    if (c->stale != NULL) {
+        cacheRelease(c->stale);
+    }
+    if (c->addrs != NULL) {
+        Free(c->addrs);
+    }
+    if (c->host != NULL) {
+        Free(c->host);
+    }
+    if (c->req != NULL) {
+        Free(c->req);
+    }
+    http_free(&c->head);
+    if (c->buf != NULL) {
+        Free(c->buf);
+    }
+    if (c->key != NULL) {
+        Free(c->key);
+    }
+    teeAbandon(&c->tee);
+    if (c->prev != NULL) {
+        c->prev->next = c->next;
+    } else {
+        liveList = c->next;
+    }
+    if (c->next != NULL) {
+        c->next->prev = c->prev;
+    }
+    c->dead = 1;
+    c->nextDead = deadList;
+    deadList = c;
+}
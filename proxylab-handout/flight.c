@@ -0,0 +1,112 @@
+/*
+ * flight.c - single-flight coalescing of concurrent cache misses
+ *
+ * When several clients miss on the same key at once only the first one
+ * (the leader) goes to the origin. The others block in flightJoin()
+ * until the leader calls flightDone(), then look in the cache again.
+ * The leader calls it once the response is cached, or as soon as the
+ * response head shows it will not be, and the followers then fetch it
+ * themselves in parallel instead of waiting out the transfer. Either way
+ * coalescing never changes what a client gets, only how many upstream
+ * fetches a burst of cold misses costs.
+ */
+#include "csapp.h"
+#include "flight.h"
+
+#define FLIGHT_BUCKETS 64
+
+typedef struct flight {
+    char* key;
+    int done;
+    int refCnt;                 /* leader + waiting followers */
+    pthread_cond_t cond;
+    struct flight* next;
+} flight_t;
+
+static flight_t* buckets[FLIGHT_BUCKETS];
+static pthread_mutex_t flightLock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int hashKey(const char* key);
+static void unref(flight_t* f);
+
+/*
+ * flightJoin - start a fetch of key, or wait for the one in progress.
+ *     Returns 1 if the caller is the leader and must call flightDone()
+ *     when the response is in the cache (or known not to be), 0 after
+ *     waiting for another leader.
+ */
+int flightJoin(const char* key)
+{
+    unsigned int h = hashKey(key);
+    flight_t* f;
+
+    pthread_mutex_lock(&flightLock);
+    for (f = buckets[h]; f != NULL; f = f->next) {
+        if (strcmp(f->key, key) == 0) {
+            break;
+        }
+    }
+    if (f == NULL) {
+        f = Malloc(sizeof(flight_t));
+        f->key = Malloc(strlen(key) + 1);
+        strcpy(f->key, key);
+        f->done = 0;
+        f->refCnt = 1;
+        pthread_cond_init(&f->cond, NULL);
+        f->next = buckets[h];
+        buckets[h] = f;
+        pthread_mutex_unlock(&flightLock);
+        return 1;
+    }
+
+    /* A leader stuck on a dead origin must not hold followers forever */
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += FLIGHT_WAIT_MAX;
+    f->refCnt++;
+    while (!f->done && pthread_cond_timedwait(&f->cond, &flightLock, &deadline) != ETIMEDOUT) {
+        ;
+    }
+    unref(f);
+    pthread_mutex_unlock(&flightLock);
+    return 0;
+}
+
+/* flightDone - the leader's fetch of key is over; wake its followers */
+void flightDone(const char* key)
+{
+    flight_t** pp = &buckets[hashKey(key)];
+
+    pthread_mutex_lock(&flightLock);
+    while (*pp != NULL && strcmp((*pp)->key, key) != 0) {
+        pp = &(*pp)->next;
+    }
+    if (*pp != NULL) {
+        flight_t* f = *pp;
+        *pp = f->next; // 之后的 miss 会开始新的 flight
+        f->done = 1;
+        pthread_cond_broadcast(&f->cond);
+        unref(f);
+    }
+    pthread_mutex_unlock(&flightLock);
+}
+
+static unsigned int hashKey(const char* key)
+{
+    unsigned int h = 5381;
+
+    while (*key) {
+        h = h * 33 + (unsigned char)*key++;
+    }
+    return h % FLIGHT_BUCKETS;
+}
+
+/* Drop a reference with flightLock held; the last one frees f */
+static void unref(flight_t* f)
+{
+    if (--f->refCnt == 0) {
+        pthread_cond_destroy(&f->cond);
+        Free(f->key);
+        Free(f);
+    }
+}
@@ -0,0 +1,12 @@
+/*
+ * flight.h - single-flight coalescing of concurrent cache misses
+ */
+#ifndef __FLIGHT_H__
+#define __FLIGHT_H__
+
+#define FLIGHT_WAIT_MAX 30      /* seconds a follower waits for the leader */
+
+int flightJoin(const char* key);
+void flightDone(const char* key);
+
+#endif /* __FLIGHT_H__ */
@@ -0,0 +1,32 @@
+#!/usr/bin/env python3
+
+# header-server.py - An origin server for headers-test.sh. It reads
+#                    each request head up to the blank line, however
+#                    large, and answers 200 with a body that reports
+#                    how many header lines arrived and the length of
+#                    the longest one, so the test can check that the
+#                    proxy forwarded them all.
+#
+# usage: header-server.py <port>
+#
+import socket
+import sys
+
+serversocket = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+serversocket.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+serversocket.bind(('', int(sys.argv[1])))
+serversocket.listen(5)
+
+while 1:
+  channel, details = serversocket.accept()
+  head = b''
+  while b'\r\n\r\n' not in head:
+    data = channel.recv(65536)
+    if not data:
+      break
+    head += data
+  lines = head.split(b'\r\n\r\n')[0].split(b'\r\n')[1:]
+  body = ('%d %d' % (len(lines), max([len(l) for l in lines] + [0]))).encode()
+  channel.sendall(b'HTTP/1.0 200 OK\r\nContent-Length: ' + str(len(body)).encode()
+                  + b'\r\nConnection: close\r\n\r\n' + body)
+  channel.close()
@@ -0,0 +1,87 @@
+#!/bin/bash
+#
+# headers-test.sh - Checks that both proxy engines, threaded and -e,
+#     forward a request with more than a hundred header lines and one
+#     with a 20 KB header line, answering 200 and passing every header
+#     on to the origin.
+#
+#     usage: ./headers-test.sh   (or make test)
+#
+
+TIMEOUT=5
+NHEADERS=150
+LONGLEN=20000
+
+failed=0
+pids=""
+
+function cleanup {
+    kill ${pids} 2> /dev/null
+}
+trap cleanup EXIT
+
+#
+# wait_for_port - spins until something listens on the TCP port
+#     passed as an argument. Gives up after 5 seconds.
+#
+function wait_for_port {
+    for i in `seq 50`
+    do
+        netstat --numeric-ports --numeric-hosts -ltn | grep -q ":${1} " && return
+        sleep 0.1
+    done
+    echo "Error: nothing is listening on port ${1}"
+    exit 1
+}
+
+#
+# check - fetch /<path> through the proxy on port $1 with the remaining
+#     curl arguments and compare the origin's report with the expected
+#     one. Each check uses its own path so no answer comes from the cache.
+# usage: check <proxy_port> <path> <what> <expected_report> <curl args...>
+#
+function check {
+    port=$1
+    path=$2
+    what=$3
+    expected=$4
+    shift 4
+    out=`curl --max-time ${TIMEOUT} --silent --write-out " %{http_code}" \
+        --proxy http://localhost:${port} "$@" http://localhost:${origin_port}/${path}`
+    if [ "${out}" == "${expected} 200" ]; then
+        echo "${what}: ok"
+    else
+        echo "${what}: FAILED (got \"${out}\", expected \"${expected} 200\")"
+        failed=1
+    fi
+}
+
+origin_port=`bash free-port.sh`
+python3 header-server.py ${origin_port} &> /dev/null &
+pids="${pids} $!"
+wait_for_port ${origin_port}
+
+many=""
+for i in `seq ${NHEADERS}`
+do
+    many="${many} -H X-Test-${i}:${i}"
+done
+long="X-Long: `head -c ${LONGLEN} < /dev/zero | tr '\0' a`"
+
+for engine in "" "-e"
+do
+    proxy_port=`bash free-port.sh`
+    ./proxy ${engine} ${proxy_port} &> /dev/null &
+    pids="${pids} $!"
+    wait_for_port ${proxy_port}
+
+    name="proxy ${engine:-(threaded)}"
+    # Host, User-Agent, Connection, Proxy-Connection and curl's Accept
+    # come on top of the test's own headers
+    check ${proxy_port} many "${name}: ${NHEADERS} headers" \
+        "$((NHEADERS + 6)) ${#long}" ${many} -H "${long}"
+    check ${proxy_port} long "${name}: one ${LONGLEN} byte header" \
+        "6 ${#long}" -H "${long}"
+done
+
+exit ${failed}
@@ -0,0 +1,57 @@
+/*
+ * httpparse.h - incremental parser for HTTP/1.x request heads, shared
+ *     by the proxy and Tiny (which keeps its own copy, as with csapp.c)
+ *
+ *     The parser never copies or allocates: it records where the
+ *     method, URI, version and each header name and value lie in the
+ *     caller's buffer. It can be called again after every read as the
+ *     buffer grows, and picks up at the first line it has not parsed.
+ *     Only a head with more than HTTP_INLHDRS headers needs memory,
+ *     which http_free() gives back.
+ */
+#ifndef __HTTPPARSE_H__
+#define __HTTPPARSE_H__
+
+#include <stddef.h>
+
+#define HTTP_INLHDRS 32      /* Headers held in http_req_t; more are malloc'd */
+
+/* http_parse_request results other than a head length */
+#define HTTP_BAD     (-1)    /* Malformed head */
+#define HTTP_PARTIAL (-2)    /* No blank line yet; read more and call again */
+#define HTTP_NOMEM   (-3)    /* Out of memory for the header array */
+
+/* $begin httpspan */
+/* Bytes of the caller's buffer, by offset so the buffer may be moved */
+typedef struct {
+    unsigned int off;
+    unsigned int len;
+} http_span_t;
+
+typedef struct {
+    http_span_t name;
+    http_span_t value;       /* Without surrounding blanks */
+} http_hdr_t;
+
+typedef struct {
+    http_span_t method;      /* Empty until the request line is parsed */
+    http_span_t uri;
+    http_span_t version;
+    int minor;               /* 1 for HTTP/1.1, 0 for HTTP/1.0 */
+    int nhdrs;
+    http_hdr_t *hdrs;        /* inl, or a larger array; do not copy the struct */
+    int maxhdrs;
+    http_hdr_t inl[HTTP_INLHDRS];
+    size_t line;             /* Start of the first line not yet parsed */
+    size_t scanned;          /* No '\n' in buf[line..scanned) */
+} http_req_t;
+/* $end httpspan */
+
+void http_init(http_req_t *rp);
+void http_free(http_req_t *rp);
+int http_parse_request(http_req_t *rp, const char *buf, size_t len);
+int http_span_is(const char *buf, http_span_t s, const char *str);
+http_hdr_t *http_header(http_req_t *rp, const char *buf, const char *name);
+char *http_span_str(char *buf, http_span_t s);
+
+#endif /* __HTTPPARSE_H__ */
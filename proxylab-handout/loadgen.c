@@ -0,0 +1,455 @@
+/*
+ * loadgen.c - load generator for the proxy and tiny
+ *
+ * Opens N concurrent connections, each driven by its own thread, and
+ * sends GET requests drawn from a weighted URL mix, either through the
+ * proxy (-x) or straight to the origin.
+ *
+ * Closed loop (default): every connection sends its next request as
+ * soon as the previous response is in.
+ *
+ * Open loop (-r rate): requests are scheduled at a fixed total rate
+ * spread over the connections. Latency is measured from the scheduled
+ * send time, not the actual one, so a stalled server shows up in the
+ * percentiles instead of silently slowing the generator down.
+ *
+ * usage: loadgen [-c conns] [-d secs] [-r rate] [-T timeout] [-k]
+ *                [-x proxyhost:port] [-f mixfile] [url ...]
+ *
+ * A mix file has one "<weight> <url>" per line; urls on the command
+ * line get weight 1. Only http://host[:port]/path urls are supported;
+ * without -x every request goes to the first url's host.
+ */
+#include "csapp.h"
+
+#define MAX_URLS 256
+
+typedef struct {
+    char host[MAXLINE];
+    char port[8];
+    char path[MAXLINE];
+    int weight;
+} target_t;
+
+typedef struct {
+    int id;
+    long* lat;                  /* latencies in microseconds */
+    size_t nLat;
+    size_t capLat;
+    unsigned long errors;
+    unsigned long bytes;
+} loadConn_t;
+
+static target_t targets[MAX_URLS];
+static int nTargets;
+static int totalWeight;
+static char proxyHost[MAXLINE];
+static char proxyPort[8];
+static int useProxy;
+static int keepAlive;
+static int nConns = 10;
+static double duration = 10;
+static double rate;             /* total requests/s, 0 for closed loop */
+static int timeoutSecs = 5;
+static long startUs;
+static long endUs;
+
+static void *connThread(void* vargp);
+static int doRequest(int fd, rio_t* rio, const target_t* t, unsigned long* bytes);
+static int readBody(rio_t* rio, long len, int chunked, unsigned long* bytes);
+static int openConn(rio_t* rio);
+static const target_t* pickTarget(unsigned int* seed);
+static int addTarget(const char* url, int weight);
+static void readMix(const char* file);
+static void record(loadConn_t* lc, long us);
+static int hasWord(const char* s, const char* word);
+static int cmpLong(const void* a, const void* b);
+static long nowUs(void);
+static void usage(const char* prog);
+
+int main(int argc, char** argv)
+{
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:d:r:T:kx:f:")) != -1) {
+        switch (opt) {
+        case 'c':
+            nConns = atoi(optarg);
+            break;
+        case 'd':
+            duration = atof(optarg);
+            break;
+        case 'r':
+            rate = atof(optarg);
+            break;
+        case 'T':
+            timeoutSecs = atoi(optarg);
+            break;
+        case 'k':
+            keepAlive = 1;
+            break;
+        case 'x':
+            if (sscanf(optarg, "%8191[^:]:%7s", proxyHost, proxyPort) != 2) {
+                usage(argv[0]);
+            }
+            useProxy = 1;
+            break;
+        case 'f':
+            readMix(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    for (; optind < argc; optind++) {
+        if (addTarget(argv[optind], 1) < 0) {
+            fprintf(stderr, "bad url: %s\n", argv[optind]);
+            exit(1);
+        }
+    }
+    if (nTargets == 0 || nConns <= 0 || duration <= 0 || rate < 0) {
+        usage(argv[0]);
+    }
+
+    /* A server closing early must not kill the generator */
+    Signal(SIGPIPE, SIG_IGN);
+
+    loadConn_t* conns = Calloc(nConns, sizeof(loadConn_t));
+    pthread_t* tids = Malloc(nConns * sizeof(pthread_t));
+    startUs = nowUs();
+    endUs = startUs + (long)(duration * 1000000);
+    for (int i = 0; i < nConns; i++) {
+        conns[i].id = i;
+        Pthread_create(&tids[i], NULL, connThread, &conns[i]);
+    }
+
+    size_t nLat = 0;
+    unsigned long errors = 0;
+    unsigned long bytes = 0;
+    for (int i = 0; i < nConns; i++) {
+        Pthread_join(tids[i], NULL);
+        nLat += conns[i].nLat;
+        errors += conns[i].errors;
+        bytes += conns[i].bytes;
+    }
+    double elapsed = (nowUs() - startUs) / 1e6;
+
+    /* Merge and sort every sample; exact percentiles are cheap at this size */
+    long* all = Malloc((nLat ? nLat : 1) * sizeof(long));
+    size_t off = 0;
+    for (int i = 0; i < nConns; i++) {
+        memcpy(all + off, conns[i].lat, conns[i].nLat * sizeof(long));
+        off += conns[i].nLat;
+        Free(conns[i].lat);
+    }
+    qsort(all, nLat, sizeof(long), cmpLong);
+
+    printf("%s loop, %d connections, %.1f s%s\n", rate > 0 ? "open" : "closed",
+           nConns, elapsed, keepAlive ? ", keep-alive" : "");
+    printf("requests    %zu ok, %lu errors\n", nLat, errors);
+    printf("throughput  %.1f req/s, %.2f MB/s\n", nLat / elapsed, bytes / elapsed / (1 << 20));
+    if (nLat > 0) {
+        double ps[] = { 0.5, 0.9, 0.99, 0.999 };
+        printf("latency us ");
+        for (int i = 0; i < 4; i++) {
+            printf(" p%g %ld", ps[i] * 100, all[(size_t)(ps[i] * (nLat - 1))]);
+        }
+        printf("  max %ld\n", all[nLat - 1]);
+    }
+
+    Free(all);
+    Free(tids);
+    Free(conns);
+    return errors > 0 && nLat == 0;
+}
+
+/* Drive one connection until the deadline */
+static void *connThread(void* vargp)
+{
+    loadConn_t* lc = vargp;
+    unsigned int seed = lc->id * 2654435761u + 1;
+    rio_t rio;
+    int fd = -1;
+
+    /* Each connection owns every nConns-th slot of the open-loop schedule */
+    double interval = rate > 0 ? nConns / rate * 1e6 : 0;
+    long next = startUs + (long)(interval * lc->id / nConns);
+
+    while (1) {
+        long sent = nowUs();
+        if (sent >= endUs) {
+            break;
+        }
+        if (rate > 0) {
+            if (next >= endUs) {
+                break;
+            }
+            if (next > sent) {
+                usleep(next - sent);
+            }
+            sent = next;
+            next += (long)interval;
+        }
+
+        if (fd < 0 && (fd = openConn(&rio)) < 0) {
+            lc->errors++;
+            usleep(1000); // 避免在 server 不可用时空转
+            continue;
+        }
+        int r = doRequest(fd, &rio, pickTarget(&seed), &lc->bytes);
+        if (r < 0) {
+            lc->errors++;
+        } else {
+            record(lc, nowUs() - sent);
+        }
+        if (r <= 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    return NULL;
+}
+
+/*
+ * doRequest - send one GET and read the whole response.
+ *     Returns 1 if the connection can be reused, 0 if the response was
+ *     complete but the connection must be closed, -1 on error.
+ */
+static int doRequest(int fd, rio_t* rio, const target_t* t, unsigned long* bytes)
+{
+    char buf[MAXLINE * 3];
+    ssize_t n;
+    int len;
+
+    if (useProxy) {
+        len = snprintf(buf, sizeof(buf), "GET http://%s:%s%s HTTP/1.%d\r\n",
+                       t->host, t->port, t->path, keepAlive);
+    } else {
+        len = snprintf(buf, sizeof(buf), "GET %s HTTP/1.%d\r\n", t->path, keepAlive);
+    }
+    len += snprintf(buf + len, sizeof(buf) - len, "Host: %s:%s\r\nConnection: %s\r\n\r\n",
+                    t->host, t->port, keepAlive ? "keep-alive" : "close");
+    if (rio_writen(fd, buf, len) != len) {
+        return -1;
+    }
+
+    int status = 0;
+    int http11 = 0;
+    int reuse = keepAlive;
+    int chunked = 0;
+    long contentLength = -1;
+    if ((n = rio_readlineb(rio, buf, MAXLINE)) <= 0
+        || sscanf(buf, "HTTP/1.%d %d", &http11, &status) != 2) {
+        return -1;
+    }
+    *bytes += n;
+    reuse = reuse && http11;
+    while (1) {
+        if ((n = rio_readlineb(rio, buf, MAXLINE)) <= 0) {
+            return -1;
+        }
+        *bytes += n;
+        if (strcmp(buf, "\r\n") == 0) {
+            break;
+        }
+        if (strncasecmp(buf, "Content-Length:", 15) == 0) {
+            contentLength = strtol(buf + 15, NULL, 10);
+        } else if (strncasecmp(buf, "Transfer-Encoding:", 18) == 0 && hasWord(buf, "chunked")) {
+            chunked = 1;
+        } else if (strncasecmp(buf, "Connection:", 11) == 0) {
+            if (hasWord(buf, "close")) {
+                reuse = 0;
+            } else if (hasWord(buf, "keep-alive")) {
+                reuse = keepAlive;
+            }
+        }
+    }
+
+    if (status / 100 == 1 || status == 204 || status == 304) {
+        contentLength = 0;
+    }
+    if (!chunked && contentLength < 0) {
+        reuse = 0; // 没有长度, 读到 server 关闭为止
+    }
+    if (readBody(rio, contentLength, chunked, bytes) < 0) {
+        return -1;
+    }
+    return status >= 400 ? -1 : reuse;
+}
+
+/* readBody - consume a body of len bytes, chunked, or (len < 0) up to EOF */
+static int readBody(rio_t* rio, long len, int chunked, unsigned long* bytes)
+{
+    char buf[MAXBUF];
+    ssize_t n;
+
+    if (chunked) {
+        while (1) {
+            if ((n = rio_readlineb(rio, buf, MAXLINE)) <= 0) {
+                return -1;
+            }
+            *bytes += n;
+            long size = strtol(buf, NULL, 16);
+            if (size == 0) {
+                break;
+            }
+            if (readBody(rio, size + 2, 0, bytes) < 0) { // 数据和结尾的 CRLF
+                return -1;
+            }
+        }
+        do { // trailer
+            if ((n = rio_readlineb(rio, buf, MAXLINE)) <= 0) {
+                return -1;
+            }
+            *bytes += n;
+        } while (strcmp(buf, "\r\n") != 0);
+        return 0;
+    }
+
+    while (len != 0) {
+        size_t want = len > 0 && len < MAXBUF ? len : MAXBUF;
+        if ((n = rio_readnb(rio, buf, want)) < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            return len < 0 ? 0 : -1;
+        }
+        *bytes += n;
+        if (len > 0) {
+            len -= n;
+        }
+    }
+    return 0;
+}
+
+/* openConn - connect to the proxy, or to the first target when direct */
+static int openConn(rio_t* rio)
+{
+    int fd;
+
+    if (useProxy) {
+        fd = open_clientfd(proxyHost, proxyPort);
+    } else {
+        fd = open_clientfd(targets[0].host, targets[0].port);
+    }
+    if (fd < 0) {
+        return -1;
+    }
+    struct timeval tv = { timeoutSecs, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    rio_readinitb(rio, fd);
+    return fd;
+}
+
+static const target_t* pickTarget(unsigned int* seed)
+{
+    int w = rand_r(seed) % totalWeight;
+
+    for (int i = 0; i < nTargets; i++) {
+        if ((w -= targets[i].weight) < 0) {
+            return &targets[i];
+        }
+    }
+    return &targets[nTargets - 1];
+}
+
+static int addTarget(const char* url, int weight)
+{
+    target_t* t = &targets[nTargets];
+    int port = 80;
+
+    if (nTargets == MAX_URLS || weight <= 0 || strncasecmp(url, "http://", 7) != 0) {
+        return -1;
+    }
+    url += 7;
+    size_t hostLen = strcspn(url, ":/");
+    if (hostLen == 0 || hostLen >= MAXLINE) {
+        return -1;
+    }
+    memcpy(t->host, url, hostLen);
+    t->host[hostLen] = 0;
+    url += hostLen;
+    if (*url == ':') {
+        port = strtol(url + 1, (char**)&url, 10);
+        if (port <= 0 || port > 65535) {
+            return -1;
+        }
+    }
+    if (*url != '/' && *url != 0) {
+        return -1;
+    }
+    snprintf(t->port, sizeof(t->port), "%d", port);
+    snprintf(t->path, sizeof(t->path), "%s", *url ? url : "/");
+    t->weight = weight;
+    totalWeight += weight;
+    nTargets++;
+    return 0;
+}
+
+static void readMix(const char* file)
+{
+    FILE* fp = Fopen(file, "r");
+    char line[MAXLINE];
+    char url[MAXLINE];
+    int weight;
+
+    while (Fgets(line, MAXLINE, fp) != NULL) {
+        if (line[0] == '#' || sscanf(line, "%d %8191s", &weight, url) != 2) {
+            continue;
+        }
+        if (addTarget(url, weight) < 0) {
+            fprintf(stderr, "%s: bad entry: %s", file, line);
+            exit(1);
+        }
+    }
+    Fclose(fp);
+}
+
+static void record(loadConn_t* lc, long us)
+{
+    if (lc->nLat == lc->capLat) {
+        lc->capLat = lc->capLat ? lc->capLat * 2 : 1024;
+        lc->lat = Realloc(lc->lat, lc->capLat * sizeof(long));
+    }
+    lc->lat[lc->nLat++] = us;
+}
+
+/* hasWord - case-insensitive substring search */
+static int hasWord(const char* s, const char* word)
+{
+    size_t len = strlen(word);
+
+    for (; *s; s++) {
+        if (strncasecmp(s, word, len) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int cmpLong(const void* a, const void* b)
+{
+    long x = *(const long*)a;
+    long y = *(const long*)b;
+
+    return (x > y) - (x < y);
+}
+
+static long nowUs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+static void usage(const char* prog)
+{
+    fprintf(stderr, "usage: %s [-c conns] [-d secs] [-r rate] [-T timeout] [-k] "
+            "[-x proxyhost:port] [-f mixfile] [url ...]\n", prog);
+    exit(1);
+}
@@ -0,0 +1,170 @@
+/*
+ * parsebench.c - request heads per second, httpparse against the
+ *     sscanf/strstr code it replaced
+ *
+ * The old path is the one the -e engine used: after every read look
+ * for "\r\n\r\n" from the start of the buffer, then sscanf() the
+ * request line and walk the header lines with strstr(), sorting each
+ * by strncasecmp() on the names addHeaderLine() knew. The new path
+ * calls http_parse_request() after every read and sorts the parsed
+ * headers by the same names with http_span_is(). Each is timed on a
+ * typical browser head and on one with 150 headers, arriving whole
+ * and in 64-byte reads.
+ *
+ * usage: parsebench [rounds]
+ */
+#include "csapp.h"
+#include "httpparse.h"
+
+#define DEFAULT_ROUNDS 200000
+#define SMALL_READ 64
+
+static const char* browserHead =
+    "GET http://www.example.com/index.html?x=1 HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Connection: keep-alive\r\n"
+    "Cookie: a=b; c=d; session=0123456789abcdef\r\n"
+    "If-None-Match: \"5f3e-1a2b\"\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "\r\n";
+
+/* The header names the proxy looks at; the rest pass through */
+static const char* names[] = {
+    "Host", "Connection", "Proxy-Connection", "Keep-Alive", "User-Agent",
+    "Content-Length", "Transfer-Encoding", "If-None-Match", "If-Modified-Since",
+};
+#define NNAMES (sizeof(names) / sizeof(names[0]))
+
+static long nowNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/* The old way; buf has room for the NUL after every read */
+static int oldParse(char* buf, const char* head, size_t len, size_t readSize)
+{
+    char method[10];
+    char url[MAXLINE];
+    char httpVersion[10];
+    size_t have = 0;
+    int known = 0;
+
+    do {
+        size_t n = len - have < readSize ? len - have : readSize;
+        memcpy(buf + have, head + have, n);
+        have += n;
+        buf[have] = 0;
+    } while (strstr(buf, "\r\n\r\n") == NULL);
+
+    if (sscanf(buf, "%9s %8191s %9s", method, url, httpVersion) != 3) {
+        return -1;
+    }
+    const char* line = strstr(buf, "\r\n") + 2;
+    const char* end;
+    while ((end = strstr(line, "\r\n")) != NULL && end != line) {
+        for (size_t i = 0; i < NNAMES; i++) {
+            size_t n = strlen(names[i]);
+            if (strncasecmp(names[i], line, n) == 0 && line[n] == ':') {
+                known++;
+                break;
+            }
+        }
+        line = end + 2;
+    }
+    return known + strlen(url);
+}
+
+static int newParse(char* buf, const char* head, size_t len, size_t readSize)
+{
+    http_req_t req;
+    size_t have = 0;
+    int rc, known = 0;
+
+    http_init(&req);
+    do {
+        size_t n = len - have < readSize ? len - have : readSize;
+        memcpy(buf + have, head + have, n);
+        have += n;
+    } while ((rc = http_parse_request(&req, buf, have)) == HTTP_PARTIAL);
+    if (rc < 0) {
+        http_free(&req);
+        return -1;
+    }
+
+    for (int h = 0; h < req.nhdrs; h++) {
+        for (size_t i = 0; i < NNAMES; i++) {
+            if (http_span_is(buf, req.hdrs[h].name, names[i])) {
+                known++;
+                break;
+            }
+        }
+    }
+    http_free(&req);
+    return known + strlen(http_span_str(buf, req.uri));
+}
+
+/* Heads per second for parse over rounds copies of head */
+static double run(int (*parse)(char*, const char*, size_t, size_t),
+                  const char* head, size_t readSize, long rounds)
+{
+    size_t len = strlen(head);
+    char* buf = Malloc(len + 1);
+    volatile int sink = 0;
+
+    long start = nowNs();
+    for (long r = 0; r < rounds; r++) {
+        sink += parse(buf, head, len, readSize);
+    }
+    long ns = nowNs() - start;
+    Free(buf);
+    return rounds / (ns / 1e9);
+}
+
+int main(int argc, char** argv)
+{
+    long rounds = argc > 1 ? atol(argv[1]) : DEFAULT_ROUNDS;
+
+    if (rounds <= 0) {
+        fprintf(stderr, "usage: %s [rounds]\n", argv[0]);
+        exit(1);
+    }
+
+    /* The browser head with 140 more headers before its blank line */
+    size_t browserLen = strlen(browserHead);
+    char* manyHead = Malloc(browserLen + 140 * 32);
+    size_t n = browserLen - 2;
+    memcpy(manyHead, browserHead, n);
+    for (int i = 0; i < 140; i++) {
+        n += sprintf(manyHead + n, "X-Extra-Header-%03d: value\r\n", i);
+    }
+    strcpy(manyHead + n, "\r\n");
+
+    const struct {
+        const char* what;
+        const char* head;
+        size_t readSize;
+        long rounds;
+    } cases[] = {
+        { "10 headers, whole", browserHead, (size_t)-1, rounds },
+        { "10 headers, 64 B reads", browserHead, SMALL_READ, rounds },
+        { "150 headers, whole", manyHead, (size_t)-1, rounds / 10 },
+        { "150 headers, 64 B reads", manyHead, SMALL_READ, rounds / 100 },
+    };
+
+    printf("%-26s %12s %12s\n", "request heads per second", "sscanf", "httpparse");
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        long r = cases[i].rounds > 0 ? cases[i].rounds : 1;
+        double before = run(oldParse, cases[i].head, cases[i].readSize, r);
+        double after = run(newParse, cases[i].head, cases[i].readSize, r);
+        printf("%-26s %11.2fM %11.2fM\n", cases[i].what, before / 1e6, after / 1e6);
+    }
+    Free(manyHead);
+    return 0;
+}
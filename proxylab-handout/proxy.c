@@ -1,174 +1,957 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
-#include <regex.h>
+#include <netinet/tcp.h>
 
 #include "csapp.h"
+#include "sbuf.h"
+#include "cache.h"
+#include "proxy.h"
+#include "relay.h"
+#include "connpool.h"
+#include "dns.h"
+#include "stats.h"
+#include "flight.h"
+#include "disk.h"
 
-/* Recommended max cache and object sizes */
-#define MAX_CACHE_SIZE 1049000
-#define MAX_OBJECT_SIZE 102400
+/* Worker pool defaults, overridable with -t and -q */
+#define THREADS_PER_CPU 4
+#define DEFAULT_SBUF_SIZE 16
 
-#define DEFAULT_PORT 80
+/* Timeouts and relay limit; see proxy.h */
+proxyLimits_t limits = { DEFAULT_CONNECT_TIMEOUT, DEFAULT_READ_TIMEOUT, DEFAULT_WRITE_TIMEOUT, 0 };
 
 /* You won't lose style points for including this long line in your code */
 static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
 static const char* connHdr = "Connection: close\r\n";
 static const char* porxyConnHdr = "Proxy-Connection: close\r\n";
+static const char* keepConnHdr = "Connection: keep-alive\r\n";
+static const char* keepProxyConnHdr = "Proxy-Connection: keep-alive\r\n";
 
+static sbuf_t connBuf; /* accepted descriptors waiting for a worker */
+
+void* worker(void* vargp);
 void forward(int connFd);
-void parseUrl(const char* url, char* host, char* position, int* port);
-void buildHttpHeader(char* http_header, const char* hostname, const char* path, int port, rio_t* client_rio);
+static int serveRequest(int connFd, rio_t* clientRio);
+static ssize_t readRequestHead(rio_t* clientRio, char* head, size_t size, http_req_t* req);
+static cacheObj_t* freshLookup(const char* key, cacheObj_t** stale);
+static int fetchResponse(int connFd, const char* host, int port, httpHeader_t* httpHeader,
+                         char* reqBody, long bodyLen, const char* key, int keepAlive,
+                         cacheObj_t* stale, int* leader);
+static int relayResponse(int connFd, rio_t* serverRio, const char* statusLine,
+                         const char* key, int clientKeepAlive, cacheObj_t* stale, int* serverKeep,
+                         int* leader);
+static void endFlight(const char* key, int* leader);
+static ssize_t relayChunked(rio_t* serverRio, int connFd);
+static void serveStats(int connFd);
+static void sendError(int connFd, const char* status);
+static int sendCached(int connFd, cacheObj_t* obj, int keepAlive);
+static int hasToken(const char* value, size_t len, const char* token);
+static void initHttpHeader(httpHeader_t* hdr);
+static int appendOther(httpHeader_t* hdr, const char* data, size_t len);
+static int addHeader(httpHeader_t* hdr, const char* head, const http_hdr_t* h, reqInfo_t* info);
+static void finishHttpHeader(httpHeader_t* hdr, const char* hostname, const char* path,
+                             const reqInfo_t* info);
 
 int main(int argc, char** argv)
 {
-    if (argc != 2) {
-        printf("error argument number");
-        return 0;
+    int opt;
+    int nThreads = 0;
+    int sbufSize = DEFAULT_SBUF_SIZE;
+    int eventMode = 0;
+    char* hostsFile = NULL;
+    char* diskDir = NULL;
+    long diskMb = DISK_DEFAULT_MB;
+
+    while ((opt = getopt(argc, argv, "t:q:eH:D:S:c:r:w:b:")) != -1) {
+        switch (opt) {
+        case 'c':
+            limits.connect = atoi(optarg);
+            break;
+        case 'r':
+            limits.read = atoi(optarg);
+            break;
+        case 'w':
+            limits.write = atoi(optarg);
+            break;
+        case 'b':
+            limits.maxInflight = atol(optarg);
+            break;
+        case 'D':
+            diskDir = optarg;
+            break;
+        case 'S':
+            diskMb = atol(optarg);
+            break;
+        case 'H':
+            hostsFile = optarg;
+            break;
+        case 'e':
+            eventMode = 1;
+            break;
+        case 't':
+            nThreads = atoi(optarg);
+            break;
+        case 'q':
+            sbufSize = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-e] [-t threads] [-q queue] [-H hostsfile] [-D diskdir [-S diskmb]] [-c connect] [-r read] [-w write] [-b bytes] <port>\n", argv[0]);
+            exit(1);
+        }
     }
+    if (optind != argc - 1 || sbufSize <= 0 || nThreads < 0 || diskMb <= 0
+        || limits.connect <= 0 || limits.read <= 0 || limits.write <= 0) {
+        fprintf(stderr, "usage: %s [-e] [-t threads] [-q queue] [-H hostsfile] [-D diskdir [-S diskmb]] [-c connect] [-r read] [-w write] [-b bytes] <port>\n", argv[0]);
+        exit(1);
+    }
+    if (nThreads == 0) { // 默认每个核若干个线程, 线程大部分时间阻塞在 I/O 上
+        long nCpu = sysconf(_SC_NPROCESSORS_ONLN);
+        nThreads = (nCpu > 0 ? nCpu : 1) * THREADS_PER_CPU;
+    }
+
+    /* A client closing early must not kill the whole proxy */
+    Signal(SIGPIPE, SIG_IGN);
 
     int listenFd;
     int connFd;
     socklen_t clientLen;
     struct sockaddr_storage clientAddr;
-    char clientHostname[MAXLINE];
-    char clientPort[MAXLINE];
+    pthread_t tid;
+
+    if (diskDir != NULL) {
+        diskInit(diskDir, (size_t)diskMb << 20);
+    }
+    cacheInit();
+    dnsInit(hostsFile);
+    relaySetLimit(limits.maxInflight);
+    listenFd = Open_listenfd(argv[optind]);
+    if (eventMode) { // 单线程 epoll 状态机, 不创建线程池
+        eventLoop(listenFd);
+        return 0;
+    }
+
+    sbuf_init(&connBuf, sbufSize);
+    for (int i = 0; i < nThreads; i++) {
+        Pthread_create(&tid, NULL, worker, NULL);
+    }
 
-    listenFd = Open_listenfd(argv[1]);
     while(1) {
         clientLen = sizeof(struct sockaddr_storage);
-        connFd = Accept(listenFd, (SA*)&clientAddr, &clientLen);
-        Getnameinfo((SA*)&clientAddr, clientLen, clientHostname, MAXLINE, clientPort, MAXLINE, 0);
-        forward(connFd);
-        Close(connFd);
+        if ((connFd = accept(listenFd, (SA*)&clientAddr, &clientLen)) < 0) {
+            fprintf(stderr, "accept error: %s\n", strerror(errno)); // 例如描述符耗尽, 稍后重试
+            if (errno == EMFILE || errno == ENFILE) {
+                usleep(10000);
+            }
+            continue;
+        }
+        sbuf_insert(&connBuf, connFd); // 满了则阻塞, 形成对 accept 的背压
     }
     
     return 0;
 }
 
-void forward(int connFd)
+void* worker(void* vargp)
 {
-    size_t n = 0;
-    char buf[MAXLINE];
-    char method[10];
-    char url[MAXLINE];
-    char httpVersion[10];
+    Pthread_detach(Pthread_self());
+    while (1) {
+        int connFd = sbuf_remove(&connBuf);
+        forward(connFd);
+        close(connFd);
+    }
+    return NULL;
+}
 
+/*
+ * forward - serve requests from one client connection until the client
+ *     closes it, goes idle, or a response cannot be framed
+ */
+void forward(int connFd)
+{
     rio_t clientRio;
+    struct timeval idle = { KEEPALIVE_TIMEOUT, 0 };
+    struct timeval wr = { limits.write, 0 };
+
+    /*
+     * A keep-alive client that goes quiet, or stops reading what we
+     * send, must not pin a worker forever
+     */
+    setsockopt(connFd, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+    setsockopt(connFd, SOL_SOCKET, SO_SNDTIMEO, &wr, sizeof(wr));
+    if (limits.maxInflight > 0) { // 限制慢速 client 在内核中占用的缓冲
+        int sndBuf = limits.maxInflight;
+        setsockopt(connFd, SOL_SOCKET, SO_SNDBUF, &sndBuf, sizeof(sndBuf));
+    }
+    /* Responses go out as several small writes; don't let Nagle hold them */
+    int one = 1;
+    setsockopt(connFd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
     Rio_readinitb(&clientRio, connFd);
+    while (serveRequest(connFd, &clientRio)) {
+        ;
+    }
+}
 
-    if ((n == Rio_readlineb(&clientRio, buf, MAXLINE)) != 0) { // 从 client 读第一行
-        sscanf(buf, "%s %s %s", method, url, httpVersion);
-        
-        if (strcmp(method, "GET") != 0) {
-            printf("Do not support %s method yet.", method);
-            exit(1);
+/*
+ * serveRequest - read one request from the client and send back its
+ *     response, from the cache or from the origin. Returns 1 if the
+ *     client connection can carry another request, 0 if it must close.
+ */
+static int serveRequest(int connFd, rio_t* clientRio)
+{
+    char head[MAX_REQ_HEADER];
+    http_req_t req;
+    ssize_t n;
+
+    if ((n = readRequestHead(clientRio, head, sizeof(head), &req)) <= 0) {
+        if (n == HTTP_BAD) {
+            sendError(connFd, "400 Bad Request");
+        } else if (n == HTTP_PARTIAL || n == HTTP_NOMEM) { // 缓冲区已满仍没有读到空行
+            sendError(connFd, "431 Request Header Fields Too Large");
         }
+        return 0;
     }
+    const char* method = http_span_str(head, req.method);
+    const char* url = http_span_str(head, req.uri);
+
+    if (strcmp(method, "GET") != 0) { // 只回复错误, 不影响其他连接
+        http_free(&req);
+        sendError(connFd, "501 Not Implemented");
+        return 0;
+    }
+    if (strcmp(url, STATS_URL) == 0) { // 直接访问代理自身的统计页面
+        http_free(&req);
+        serveStats(connFd);
+        return 0;
+    }
+
+    long start = statsNow();
+    statsAdd(STAT_REQUESTS, 1);
 
     char host[MAXLINE];
     char position[MAXLINE];
     int port;
-    parseUrl(url, host, position, &port);
+    if (parseUrl(url, host, position, &port) < 0) {
+        http_free(&req);
+        sendError(connFd, "400 Bad Request");
+        return 0;
+    }
 
-    char httpHeader[MAXLINE];
-    buildHttpHeader(httpHeader, host, position, port, &clientRio);
+    httpHeader_t httpHeader;
+    reqInfo_t info;
+    info.http11 = req.minor == 1;
+    info.pooled = 1;
+    int built = buildHttpHeader(&httpHeader, host, position, head, &req, &info);
+    http_free(&req); // 之后只用 httpHeader
+    if (built < 0) {
+        sendError(connFd, "431 Request Header Fields Too Large");
+        return 0;
+    }
 
-    int serverFd;
-    char portStr[65];
+    /*
+     * A GET body is rare but must be consumed to keep the framing. Only
+     * one with a Content-Length that fits in reqBody is forwarded; the
+     * client is told why anything else is refused.
+     */
+    char reqBody[MAXBUF];
+    long bodyLen = info.contentLength > 0 ? info.contentLength : 0;
+    if (info.chunked || bodyLen > MAXBUF) {
+        freeHttpHeader(&httpHeader);
+        sendError(connFd, info.chunked ? "411 Length Required" : "413 Payload Too Large");
+        return 0;
+    }
+    if (bodyLen > 0 && rio_readnb(clientRio, reqBody, bodyLen) != bodyLen) { // client 中途离开
+        freeHttpHeader(&httpHeader);
+        return 0;
+    }
 
-    sprintf(portStr, "%d", port);
-    serverFd = Open_clientfd(host, portStr);
-    
+    /*
+     * On a miss only the first of several concurrent requests for the
+     * same key fetches it; the rest wait for it and look again. A stale
+     * copy with validators is revalidated with a conditional request.
+     */
+    char key[MAXLINE];
+    int leader = 0;
+    cacheObj_t* stale = NULL;
+    cacheKey(key, sizeof(key), host, port, position);
+    cacheObj_t* obj = freshLookup(key, &stale);
+    if (obj == NULL && (leader = flightJoin(key)) == 0 && (obj = freshLookup(key, &stale)) != NULL) {
+        statsAdd(STAT_COALESCED, 1);
+    }
+    if (stale != NULL && (obj != NULL || info.conditional)) { // client 自带校验条件时原样转发
+        cacheRelease(stale);
+        stale = NULL;
+    }
+    if (obj != NULL) { // 命中则直接从缓存返回, 不再访问 server
+        freeHttpHeader(&httpHeader);
+        statsAdd(STAT_CACHE_HITS, 1);
+        int ok = sendCached(connFd, obj, info.keepAlive);
+        statsAdd(STAT_BYTES_OUT, obj->size);
+        cacheRelease(obj);
+        statsLatency(start);
+        return ok && info.keepAlive;
+    }
+    statsAdd(STAT_CACHE_MISSES, 1);
+
+    if (stale != NULL) {
+        setConditional(&httpHeader, stale->etag, stale->etagLen,
+                       stale->lastModified, stale->lastModifiedLen);
+    }
+    int clientKeep = fetchResponse(connFd, host, port, &httpHeader, reqBody, bodyLen, key,
+                                   info.keepAlive, stale, &leader);
+    if (stale != NULL) {
+        cacheRelease(stale);
+    }
+    endFlight(key, &leader);
+    statsLatency(start);
+    return clientKeep;
+}
+
+/* endFlight - as the leader of the fetch of key, wake its followers once */
+static void endFlight(const char* key, int* leader)
+{
+    if (*leader) {
+        flightDone(key);
+        *leader = 0;
+    }
+}
+
+/*
+ * readRequestHead - read a request head of at most size - 1 bytes into
+ *     head a line at a time, parsing it into *req as it grows. Returns
+ *     its length, 0 if the client went away, HTTP_BAD if it is
+ *     malformed, HTTP_PARTIAL if it does not fit or HTTP_NOMEM. Only
+ *     on success must the caller http_free() *req.
+ */
+static ssize_t readRequestHead(rio_t* clientRio, char* head, size_t size, http_req_t* req)
+{
+    size_t len = 0;
+    ssize_t n;
+    int rc;
+
+    http_init(req);
+    do {
+        if (len == size - 1) {
+            rc = HTTP_PARTIAL;
+            break;
+        }
+        if ((n = rio_readlineb(clientRio, head + len, size - len)) <= 0) {
+            rc = 0;
+            break;
+        }
+        len += n;
+    } while ((rc = http_parse_request(req, head, len)) == HTTP_PARTIAL);
+    if (rc <= 0) {
+        http_free(req);
+    }
+    return rc;
+}
+
+/*
+ * freshLookup - cacheLookup() that only returns fresh objects. A stale
+ *     one that can be revalidated is handed back in *stale instead, if
+ *     *stale is still empty; the caller releases it.
+ */
+static cacheObj_t* freshLookup(const char* key, cacheObj_t** stale)
+{
+    cacheObj_t* obj = cacheLookup(key);
+
+    if (obj == NULL || cacheFresh(obj)) {
+        return obj;
+    }
+    if (*stale == NULL && (obj->etag != NULL || obj->lastModified != NULL)) {
+        *stale = obj;
+    } else {
+        cacheRelease(obj);
+    }
+    return NULL;
+}
+
+/*
+ * fetchResponse - send the request in httpHeader to host:port and relay
+ *     the response to the client, caching it under key when possible.
+ *     stale is the cached copy being revalidated, or NULL. Frees
+ *     httpHeader. Returns 1 if the client connection can carry another
+ *     request, 0 if it must close.
+ */
+static int fetchResponse(int connFd, const char* host, int port, httpHeader_t* httpHeader,
+                         char* reqBody, long bodyLen, const char* key, int keepAlive,
+                         cacheObj_t* stale, int* leader)
+{
+    ssize_t n;
+    char buf[MAXLINE];
+
+    /*
+     * Prefer an idle pooled connection to the origin. The server may
+     * have closed it in the meantime, so a pooled socket that fails
+     * before the status line arrives is retried once on a fresh one.
+     */
+    int serverFd;
+    int reused;
     rio_t serverRio;
-    Rio_readinitb(&serverRio, serverFd);
-    
-    Rio_writen(serverFd, httpHeader, sizeof(httpHeader)); // send http request to server
+    long fetchStart = statsNow();
+
+    while (1) {
+        if ((serverFd = poolGet(host, port)) >= 0) {
+            reused = 1;
+        } else if ((serverFd = dnsOpenClientfd(host, port, limits.connect * 1000)) >= 0) {
+            struct timeval rd = { limits.read, 0 };
+            struct timeval wr = { limits.write, 0 };
+            setsockopt(serverFd, SOL_SOCKET, SO_RCVTIMEO, &rd, sizeof(rd)); // 池中的连接沿用这些设置
+            setsockopt(serverFd, SOL_SOCKET, SO_SNDTIMEO, &wr, sizeof(wr));
+            reused = 0;
+        } else {
+            statsAdd(STAT_CONNECT_FAILURES, 1);
+            freeHttpHeader(httpHeader);
+            sendError(connFd, errno == ETIMEDOUT ? "504 Gateway Timeout" : "502 Bad Gateway");
+            return 0;
+        }
+        Rio_readinitb(&serverRio, serverFd);
 
-    while((n = Rio_readlineb(&serverRio, buf, MAXLINE)) != 0) {  // 接收 server 的信息
-        Rio_writen(connFd, buf, n);                             // 转发给 client
+        errno = 0;
+        if (sendHttpHeader(serverFd, httpHeader, reqBody, bodyLen) == 0 // send http request to server
+            && (n = rio_readlineb(&serverRio, buf, MAXLINE)) > 0) {
+            break;
+        }
+        int timedOut = errno == EAGAIN || errno == EWOULDBLOCK;
+        close(serverFd);
+        if (!reused) {
+            freeHttpHeader(httpHeader);
+            sendError(connFd, timedOut ? "504 Gateway Timeout" : "502 Bad Gateway");
+            return 0;
+        }
     }
+    freeHttpHeader(httpHeader);
+    statsTtfb(fetchStart);
 
-    Close(serverFd);
+    int serverKeep = 0;
+    int clientKeep = relayResponse(connFd, &serverRio, buf, key, keepAlive, stale, &serverKeep, leader);
+    if (serverKeep) {
+        poolPut(host, port, serverFd);
+    } else {
+        close(serverFd);
+    }
+    return clientKeep;
 }
 
-void parseUrl(const char* url, char* host, char* position, int* port)
+/*
+ * relayResponse - relay the response whose status line is in statusLine
+ *     from serverRio to the client, caching it under key if it is a
+ *     complete 200 response that fits in MAX_OBJECT_SIZE. Hop-by-hop
+ *     headers are replaced by our own Connection header. A 304 answer
+ *     to the revalidation of stale renews it and sends it instead.
+ *     Returns 1 if the client connection can be kept open; *serverKeep
+ *     is set if the server connection can be reused.
+ */
+static int relayResponse(int connFd, rio_t* serverRio, const char* statusLine,
+                         const char* key, int clientKeepAlive, cacheObj_t* stale, int* serverKeep,
+                         int* leader)
 {
-    char* pattern = "https?:\\/\\/([^/:]+)(:\\d*)?([^# ]*)";
-    regex_t reg;
-    int err;
-    char errbuf[1024];
+    int serverFd = serverRio->rio_fd;
+    char buf[MAXLINE];
+    ssize_t n;
+    int minor = 0;
+    int status = 0;
 
-    if ((err = regcomp(&reg, pattern, REG_EXTENDED)) != 0) {
-        regerror(err, &reg, errbuf, sizeof(errbuf));
-        printf("err: %s\n", errbuf);
-        regfree(&reg);
-        exit(1);
+    *serverKeep = 0;
+    sscanf(statusLine, "HTTP/1.%d %d", &minor, &status);
+    int keep = minor >= 1; // HTTP/1.1 默认是持久连接
+    int cacheable = status == 200;
+    int chunked = 0;
+    long contentLength = -1;
+
+    /*
+     * Collect status line and end-to-end headers in the tee, which
+     * then keeps a copy of the body for the cache while it fits
+     */
+    tee_t tee;
+    teeInit(&tee, MAX_OBJECT_SIZE);
+    teeAppend(&tee, statusLine, strlen(statusLine));
+
+    while (1) {
+        if ((n = rio_readlineb(serverRio, buf, MAXLINE)) <= 0) { // 还没有向 client 发送任何内容
+            teeAbandon(&tee);
+            int timedOut = n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+            sendError(connFd, timedOut ? "504 Gateway Timeout" : "502 Bad Gateway");
+            return 0;
+        }
+        if (strncasecmp(buf, "Connection:", 11) == 0 || strncasecmp(buf, "Proxy-Connection:", 17) == 0) {
+            const char* value = strchr(buf, ':') + 1;
+            if (hasToken(value, buf + n - value, "close")) {
+                keep = 0;
+            } else if (hasToken(value, buf + n - value, "keep-alive")) {
+                keep = 1;
+            }
+            continue;
+        }
+        if (strncasecmp(buf, "Keep-Alive:", 11) == 0) {
+            continue;
+        }
+        if (strncasecmp(buf, "Content-Length:", 15) == 0) {
+            contentLength = strtol(buf + 15, NULL, 10);
+        }
+        if (strncasecmp(buf, "Transfer-Encoding:", 18) == 0 && hasToken(buf + 18, n - 18, "chunked")) {
+            chunked = 1;
+            cacheable = 0;
+        }
+        if (!teeAppend(&tee, buf, n)) { // 响应头过长
+            sendError(connFd, "502 Bad Gateway");
+            return 0;
+        }
+        if (strcmp(buf, "\r\n") == 0) {
+            break;
+        }
     }
+    size_t hdrSize = tee.size;
 
-    size_t nmatch = 3;
-    regmatch_t pmatch[nmatch + 1];
-    err = regexec(&reg, url, nmatch, pmatch, 0);
-    if (err) {
-        regerror(err, &reg, errbuf, sizeof(errbuf));
-        printf("err: %s\n", errbuf);
-        regfree(&reg);
-        exit(1);
+    if (stale != NULL && status == 304) { // 缓存的副本仍然有效, 不用重传 body
+        cacheRefresh(stale, tee.buf, hdrSize);
+        endFlight(key, leader); // 跟随者现在就能命中刷新后的副本
+        teeAbandon(&tee);
+        statsAdd(STAT_REVALIDATED, 1);
+        statsAdd(STAT_BYTES_IN, hdrSize);
+        statsAdd(STAT_BYTES_OUT, stale->size);
+        *serverKeep = keep && serverRio->rio_cnt == 0;
+        return sendCached(connFd, stale, clientKeepAlive) && clientKeepAlive;
     }
 
-    int len = 0;
-    if (pmatch[1].rm_so != -1) {
-        len = pmatch[1].rm_eo - pmatch[1].rm_so;
-        memcpy(host, url + pmatch[1].rm_so, len);
-        host[len] = 0;
+    /* Without a length the body ends when the server closes */
+    int noBody = status / 100 == 1 || status == 204 || status == 304;
+    int framed = noBody || chunked || contentLength >= 0;
+    if (!framed) {
+        keep = 0;
     }
+    int clientKeep = clientKeepAlive && framed;
 
-    if (pmatch[2].rm_so != -1) {
-        len = pmatch[2].rm_eo - pmatch[2].rm_so - 1; // - 1 剪掉冒号长度
-        char tmp[64 + 1];
-        memcpy(tmp, url + pmatch[2].rm_so + 1, len); // + 1 除去冒号
-        tmp[len] = 0;
-        *port = atoi(tmp);
+    /*
+     * A response the head already rules out of the cache would only
+     * hold the followers of this fetch for its whole transfer; let them
+     * fetch it themselves now
+     */
+    if (!cacheable || (contentLength >= 0 && hdrSize + contentLength > MAX_OBJECT_SIZE)
+        || !cacheStorable(tee.buf, hdrSize)) {
+        endFlight(key, leader);
+    }
+
+    const char* connLine = clientKeep ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+    if (rio_writen(connFd, tee.buf, hdrSize - 2) != hdrSize - 2            // 转发给 client
+        || rio_writen(connFd, (void*)connLine, strlen(connLine)) != strlen(connLine)) {
+        teeAbandon(&tee);
+        return 0;
+    }
+    if (!cacheable) {
+        teeAbandon(&tee);
+    }
+
+    int ok = 1;
+    size_t relayed = hdrSize;
+    if (noBody) {
+        ;
+    } else if (chunked) {
+        ssize_t body = relayChunked(serverRio, connFd);
+        ok = body >= 0;
+        relayed += ok ? body : 0;
     } else {
-        *port = DEFAULT_PORT;
+        /* Body bytes that were already pulled into serverRio's buffer */
+        long bodyLeft = contentLength;
+        n = serverRio->rio_cnt;
+        if (bodyLeft >= 0 && n > bodyLeft) { // server 多发了数据, 连接不能复用
+            n = bodyLeft;
+            keep = 0;
+        }
+        if (n > 0) {
+            ok = rio_writen(connFd, serverRio->rio_bufptr, n) == n;
+            teeAppend(&tee, serverRio->rio_bufptr, n);
+            serverRio->rio_bufptr += n;
+            serverRio->rio_cnt -= n;
+            relayed += n;
+            if (bodyLeft >= 0) {
+                bodyLeft -= n;
+            }
+        }
+
+        /*
+         * The rest of the body streams through the tee stage, which
+         * drops its copy as soon as the response outgrows the cache and
+         * splice()s the remainder across
+         */
+        if (ok && bodyLeft != 0) {
+            ssize_t body = relayTee(serverFd, connFd, bodyLeft, &tee);
+            ok = bodyLeft < 0 ? body >= 0 : body == bodyLeft;
+            relayed += body > 0 ? body : 0;
+        }
     }
 
-    if (pmatch[3].rm_so != -1) {
-        len = pmatch[3].rm_eo - pmatch[3].rm_so;
-        memcpy(position, url + pmatch[3].rm_so, len);
-        position[len] = 0;
+    if (ok && !tee.dropped) {
+        if (framed) {
+            cacheInsert(key, tee.buf, tee.size);
+        } else {
+            insertUnframed(key, tee.buf, hdrSize, tee.size - hdrSize);
+        }
     }
+    teeAbandon(&tee);
+    statsAdd(STAT_BYTES_IN, relayed);
+    statsAdd(STAT_BYTES_OUT, relayed);
+    *serverKeep = ok && keep && serverRio->rio_cnt == 0;
+    return ok && clientKeep;
+}
 
-    regfree(&reg);
+/*
+ * insertUnframed - cache a response whose body ran to EOF, adding the
+ *     Content-Length it lacked so the copy can be replayed on a
+ *     keep-alive connection
+ */
+void insertUnframed(const char* key, const char* data, size_t hdrSize, size_t bodySize)
+{
+    char lenHdr[64];
+    int lenSize = snprintf(lenHdr, sizeof(lenHdr), "Content-Length: %zu\r\n", bodySize);
+    char* obj = Malloc(hdrSize + lenSize + bodySize);
+
+    memcpy(obj, data, hdrSize - 2);
+    memcpy(obj + hdrSize - 2, lenHdr, lenSize);
+    memcpy(obj + hdrSize - 2 + lenSize, data + hdrSize - 2, bodySize + 2);
+    cacheInsert(key, obj, hdrSize + lenSize + bodySize);
+    Free(obj);
 }
 
-void buildHttpHeader(char* http_header, const char* hostname, const char* path, int port, rio_t* client_rio)
+/*
+ * relayChunked - relay a chunked body, chunk-size lines, data and
+ *     trailers unchanged. Returns the bytes relayed, -1 on error.
+ */
+static ssize_t relayChunked(rio_t* serverRio, int connFd)
 {
-    char buf[MAXLINE];
-    char hostHdr[MAXLINE] = {0};
-    char otherHdrs[MAXLINE] = {0};
-    int n;
+    char buf[MAXBUF];
+    ssize_t n;
+    ssize_t total = 0;
 
-    while((n = Rio_readlineb(client_rio, buf, MAXLINE)) != 0) {
-        if (strcmp(buf, "\r\n") == 0) {
+    while (1) {
+        if ((n = rio_readlineb(serverRio, buf, MAXLINE)) <= 0 || rio_writen(connFd, buf, n) != n) {
+            return -1;
+        }
+        total += n;
+        long left = strtol(buf, NULL, 16);
+        if (left == 0) {
             break;
         }
+        for (left += 2; left > 0; left -= n) { // 数据之后还有 CRLF
+            n = left < MAXBUF ? left : MAXBUF;
+            if (rio_readnb(serverRio, buf, n) != n || rio_writen(connFd, buf, n) != n) {
+                return -1;
+            }
+            total += n;
+        }
+    }
 
-        if (strncmp("HOST: ", buf, 6) == 0) {
-            strcpy(hostHdr, buf);
-            continue;
+    /* Trailer lines up to the blank line */
+    do {
+        if ((n = rio_readlineb(serverRio, buf, MAXLINE)) <= 0 || rio_writen(connFd, buf, n) != n) {
+            return -1;
+        }
+        total += n;
+    } while (strcmp(buf, "\r\n") != 0);
+    return total;
+}
+
+/*
+ * errorResponse - a complete response with the given status, such as
+ *     "502 Bad Gateway", for errors the proxy itself reports. The
+ *     connection is closed after it. Returns a Malloc'ed buffer.
+ */
+char* errorResponse(const char* status, size_t* len)
+{
+    size_t size = 2 * strlen(status) + 128;
+    char* resp = Malloc(size);
+
+    *len = snprintf(resp, size, "HTTP/1.0 %s\r\n"
+                    "Content-Type: text/plain\r\n"
+                    "Content-Length: %zu\r\n"
+                    "Connection: close\r\n\r\n"
+                    "%s\n", status, strlen(status) + 1, status);
+    return resp;
+}
+
+static void sendError(int connFd, const char* status)
+{
+    size_t len;
+    char* resp = errorResponse(status, &len);
+
+    rio_writen(connFd, resp, len);
+    Free(resp);
+}
+
+/*
+ * serveStats - answer a request for STATS_URL made directly to the
+ *     proxy. The connection is closed afterwards.
+ */
+static void serveStats(int connFd)
+{
+    size_t len;
+    char* resp = statsResponse(&len);
+
+    rio_writen(connFd, resp, len);
+    Free(resp);
+}
+
+/*
+ * sendCached - send a cached response, adding our Connection header at
+ *     the end of its headers. Returns 1 on success, 0 on write error.
+ */
+static int sendCached(int connFd, cacheObj_t* obj, int keepAlive)
+{
+    size_t hdrEnd = 0;
+    const char* connLine = keepAlive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+
+    while (hdrEnd + 4 <= obj->size && memcmp(obj->data + hdrEnd, "\r\n\r\n", 4) != 0) {
+        hdrEnd++;
+    }
+    if (hdrEnd + 4 > obj->size) {
+        return rio_writen(connFd, obj->data, obj->size) == obj->size;
+    }
+    hdrEnd += 2; // 保留最后一个头部行的 CRLF
+
+    return rio_writen(connFd, obj->data, hdrEnd) == hdrEnd
+        && rio_writen(connFd, (void*)connLine, strlen(connLine)) == strlen(connLine)
+        && rio_writen(connFd, obj->data + hdrEnd + 2, obj->size - hdrEnd - 2) == obj->size - hdrEnd - 2;
+}
+
+/* hasToken - does the len byte header value contain token? */
+static int hasToken(const char* value, size_t len, const char* token)
+{
+    size_t tokLen = strlen(token);
+
+    for (; len >= tokLen; value++, len--) {
+        if (strncasecmp(value, token, tokLen) == 0) {
+            return 1;
         }
+    }
+    return 0;
+}
 
-        if (strncmp("Connection: ", buf, 12) && strncmp("Proxy-Connection: ", buf, 18) && strncmp("User-Agent: ", buf, 12)) {
-            strcat(otherHdrs, buf);
+/*
+ * buildHttpHeader - build the request we send to the server from the
+ *     client's headers, parsed into req from head. With info
+ *     (info->http11 and info->pooled set by the caller) the rest of info
+ *     is filled in from the headers. Returns 0 on success, -1 if they come to
+ *     more than MAX_REQ_HEADER bytes.
+ */
+int buildHttpHeader(httpHeader_t* hdr, const char* hostname, const char* path,
+                    const char* head, const http_req_t* req, reqInfo_t* info)
+{
+    initHttpHeader(hdr);
+    if (info != NULL) {
+        info->keepAlive = info->http11;
+        info->contentLength = -1;
+        info->chunked = 0;
+        info->conditional = 0;
+    }
+    for (int i = 0; i < req->nhdrs; i++) {
+        if (addHeader(hdr, head, &req->hdrs[i], info) < 0) {
+            freeHttpHeader(hdr);
+            return -1;
         }
     }
 
-    if (strlen(hostHdr) == 0) {
-        sprintf(hostHdr, "HOST: %s\r\n", hostname);
+    finishHttpHeader(hdr, hostname, path, info);
+    return 0;
+}
+
+/*
+ * setConditional - turn the request into a conditional one for a cached
+ *     copy with the given validators (either may be NULL)
+ */
+void setConditional(httpHeader_t* hdr, const char* etag, size_t etagLen,
+                    const char* lastModified, size_t lastModifiedLen)
+{
+    size_t n = 0;
+
+    if (etag != NULL && etagLen < MAXLINE / 2) {
+        n += sprintf(hdr->condHdr + n, "If-None-Match: %.*s\r\n", (int)etagLen, etag);
     }
+    if (lastModified != NULL && lastModifiedLen < MAXLINE / 2) {
+        n += sprintf(hdr->condHdr + n, "If-Modified-Since: %.*s\r\n", (int)lastModifiedLen, lastModified);
+    }
+    hdr->iov[COND_IOV].iov_len = n;
+}
 
-    char requestHdr[MAXLINE];
-    sprintf(requestHdr, "GET %s HTTP/1.0\r\n", path);
-    sprintf(http_header, "%s%s%s%s%s%s\r\n", requestHdr, hostHdr, connHdr, porxyConnHdr, user_agent_hdr, otherHdrs);
-}
\ No newline at end of file
+/*
+ * sendHttpHeader - send the request head, followed by bodyLen bytes of
+ *     body, with as few writev() calls as the socket allows. Returns 0
+ *     on success, -1 on error.
+ */
+int sendHttpHeader(int fd, const httpHeader_t* hdr, void* body, size_t bodyLen)
+{
+    struct iovec iov[HDR_IOVS + 1];
+    struct iovec* p = iov;
+    int cnt = hdr->iovCnt;
+
+    memcpy(iov, hdr->iov, cnt * sizeof(struct iovec));
+    if (bodyLen > 0) {
+        iov[cnt].iov_base = body;
+        iov[cnt].iov_len = bodyLen;
+        cnt++;
+    }
+
+    while (cnt > 0) {
+        ssize_t n = writev(fd, p, cnt);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        while (cnt > 0 && (size_t)n >= p->iov_len) { // 跳过已经写完的部分
+            n -= p->iov_len;
+            p++;
+            cnt--;
+        }
+        if (cnt > 0) {
+            p->iov_base = (char*)p->iov_base + n;
+            p->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+/*
+ * flattenHttpHeader - copy the request head into one Malloc'ed buffer,
+ *     for callers that write it in non-blocking pieces
+ */
+char* flattenHttpHeader(const httpHeader_t* hdr, size_t* len)
+{
+    size_t total = 0;
+
+    for (int i = 0; i < hdr->iovCnt; i++) {
+        total += hdr->iov[i].iov_len;
+    }
+    char* flat = Malloc(total + 1);
+    char* p = flat;
+    for (int i = 0; i < hdr->iovCnt; i++) {
+        memcpy(p, hdr->iov[i].iov_base, hdr->iov[i].iov_len);
+        p += hdr->iov[i].iov_len;
+    }
+    *p = 0;
+    *len = total;
+    return flat;
+}
+
+void freeHttpHeader(httpHeader_t* hdr)
+{
+    if (hdr->other != NULL) {
+        Free(hdr->other);
+        hdr->other = NULL;
+    }
+}
+
+static void initHttpHeader(httpHeader_t* hdr)
+{
+    hdr->hostHdr[0] = 0;
+    hdr->other = NULL;
+    hdr->otherLen = hdr->otherCap = 0;
+    hdr->iovCnt = 0;
+}
+
+/* Append to the pass-through headers, doubling the buffer as needed */
+static int appendOther(httpHeader_t* hdr, const char* data, size_t len)
+{
+    if (hdr->otherLen + len > MAX_REQ_HEADER) {
+        return -1;
+    }
+    if (hdr->otherLen + len > hdr->otherCap) {
+        hdr->otherCap = hdr->otherCap ? hdr->otherCap * 2 : MAXLINE;
+        while (hdr->otherCap < hdr->otherLen + len) {
+            hdr->otherCap *= 2;
+        }
+        hdr->other = Realloc(hdr->other, hdr->otherCap);
+    }
+    memcpy(hdr->other + hdr->otherLen, data, len);
+    hdr->otherLen += len;
+    return 0;
+}
+
+/*
+ * addHeader - sort one client header: Host is kept aside, hop-by-hop
+ *     headers are dropped (recording what they ask for in info, if
+ *     given) and everything else is passed through. Returns -1 if the
+ *     headers grew too large.
+ */
+static int addHeader(httpHeader_t* hdr, const char* head, const http_hdr_t* h, reqInfo_t* info)
+{
+    const char* value = head + h->value.off;
+    size_t len = h->value.len;
+
+    if (http_span_is(head, h->name, "Host")) {
+        if (len >= MAXLINE - 9) {
+            return -1;
+        }
+        sprintf(hdr->hostHdr, "Host: %.*s\r\n", (int)len, value);
+        return 0;
+    }
+
+    if (http_span_is(head, h->name, "Connection") || http_span_is(head, h->name, "Proxy-Connection")) {
+        if (info != NULL && hasToken(value, len, "close")) {
+            info->keepAlive = 0;
+        } else if (info != NULL && hasToken(value, len, "keep-alive")) {
+            info->keepAlive = 1;
+        }
+        return 0;
+    }
+    if (http_span_is(head, h->name, "Keep-Alive") || http_span_is(head, h->name, "User-Agent")) {
+        return 0;
+    }
+
+    if (info != NULL && http_span_is(head, h->name, "Content-Length")) {
+        info->contentLength = strtol(value, NULL, 10); // 值后面总是 CR 或 LF
+    }
+    if (info != NULL && http_span_is(head, h->name, "Transfer-Encoding")) {
+        info->chunked = 1;
+    }
+    if (info != NULL && (http_span_is(head, h->name, "If-None-Match")
+                         || http_span_is(head, h->name, "If-Modified-Since"))) {
+        info->conditional = 1;
+    }
+
+    /* Pass it through as "Name: value", whatever spacing the client used */
+    if (appendOther(hdr, head + h->name.off, h->name.len) < 0
+        || appendOther(hdr, ": ", 2) < 0
+        || appendOther(hdr, value, len) < 0
+        || appendOther(hdr, "\r\n", 2) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * finishHttpHeader - lay out the request line and headers as iovecs.
+ *     A pooled request keeps the client's HTTP version and asks the
+ *     server for a persistent connection; any other (event mode) is an
+ *     HTTP/1.0 request with Connection: close.
+ */
+static void finishHttpHeader(httpHeader_t* hdr, const char* hostname, const char* path,
+                             const reqInfo_t* info)
+{
+    if (hdr->hostHdr[0] == 0) {
+        if (strchr(hostname, ':') != NULL) { // IPv6 字面量要加回方括号
+            snprintf(hdr->hostHdr, MAXLINE, "Host: [%s]\r\n", hostname);
+        } else {
+            snprintf(hdr->hostHdr, MAXLINE, "Host: %s\r\n", hostname);
+        }
+    }
+    int pooled = info != NULL && info->pooled;
+    snprintf(hdr->requestLine, MAXLINE, "GET %s HTTP/1.%d\r\n", path, pooled && info->http11);
+
+    const char* parts[HDR_IOVS] = {
+        hdr->requestLine, hdr->hostHdr,
+        pooled ? keepConnHdr : connHdr, pooled ? keepProxyConnHdr : porxyConnHdr,
+        user_agent_hdr, NULL, hdr->condHdr, "\r\n"
+    };
+    hdr->condHdr[0] = 0; // 由 setConditional 填写
+    for (int i = 0; i < HDR_IOVS; i++) {
+        if (parts[i] != NULL) {
+            hdr->iov[i].iov_base = (void*)parts[i];
+            hdr->iov[i].iov_len = strlen(parts[i]);
+        } else { // client 的其余头部
+            hdr->iov[i].iov_base = hdr->other;
+            hdr->iov[i].iov_len = hdr->otherLen;
+        }
+    }
+    hdr->iovCnt = HDR_IOVS;
+}
@@ -0,0 +1,76 @@
+/*
+ * proxy.h - helpers shared by the threaded and the event-driven proxy
+ */
+#ifndef __PROXY_H__
+#define __PROXY_H__
+
+#include <sys/uio.h>
+
+#include "csapp.h"
+#include "httpparse.h"
+
+#define DEFAULT_PORT 80
+
+/* Default timeouts in seconds, overridable with -c, -r and -w */
+#define DEFAULT_CONNECT_TIMEOUT 5
+#define DEFAULT_READ_TIMEOUT 30
+#define DEFAULT_WRITE_TIMEOUT 30
+
+#define KEEPALIVE_TIMEOUT 5     /* seconds an idle client connection is kept open */
+
+/* Process-wide limits, set once from the command line */
+typedef struct {
+    int connect;                /* seconds to establish an upstream connection */
+    int read;                   /* seconds an upstream read may block */
+    int write;                  /* seconds a write to either side may block */
+    size_t maxInflight;         /* bytes buffered per connection, 0 for default (-b) */
+} proxyLimits_t;
+
+extern proxyLimits_t limits;
+
+/* What the proxy learned from a client's request headers */
+typedef struct {
+    int http11;                 /* request line said HTTP/1.1 */
+    int pooled;                 /* server connection is kept for reuse (threaded mode) */
+    int keepAlive;              /* client wants the connection kept open */
+    long contentLength;         /* request body length, -1 if none */
+    int chunked;                /* request body has a Transfer-Encoding */
+    int conditional;            /* client sent its own If-None-Match/If-Modified-Since */
+} reqInfo_t;
+
+#define MAX_REQ_HEADER (64 * 1024) /* cap on a client's request head */
+#define HDR_IOVS 8
+#define COND_IOV 6              /* iovec of the revalidation headers */
+
+/*
+ * The request head sent to the server. Our own lines live in fixed
+ * buffers or constants and the client's pass-through headers in one
+ * growable buffer, so building it is linear in the header bytes no
+ * matter how many headers there are. It goes out with one writev().
+ */
+typedef struct {
+    char requestLine[MAXLINE];
+    char hostHdr[MAXLINE];
+    char condHdr[MAXLINE];      /* If-None-Match/If-Modified-Since we add */
+    char* other;                /* pass-through client headers */
+    size_t otherLen;
+    size_t otherCap;
+    struct iovec iov[HDR_IOVS];
+    int iovCnt;
+} httpHeader_t;
+
+int parseUrl(const char* url, char* host, char* position, int* port);
+int buildHttpHeader(httpHeader_t* hdr, const char* hostname, const char* path,
+                    const char* head, const http_req_t* req, reqInfo_t* info);
+void setConditional(httpHeader_t* hdr, const char* etag, size_t etagLen,
+                    const char* lastModified, size_t lastModifiedLen);
+int sendHttpHeader(int fd, const httpHeader_t* hdr, void* body, size_t bodyLen);
+char* flattenHttpHeader(const httpHeader_t* hdr, size_t* len);
+char* errorResponse(const char* status, size_t* len);
+void insertUnframed(const char* key, const char* data, size_t hdrSize, size_t bodySize);
+void freeHttpHeader(httpHeader_t* hdr);
+
+/* evloop.c */
+void eventLoop(int listenFd);
+
+#endif /* __PROXY_H__ */
@@ -0,0 +1,262 @@
+/*
+ * relay.c - bulk copy of a response body from one socket to another
+ *
+ * The body is moved with splice() through a per-thread pipe, so it is
+ * never copied into user space. Kept apart from csapp.c because
+ * splice() needs _GNU_SOURCE, whose <netdb.h> clashes with csapp.h's
+ * gai_error().
+ *
+ * relayTee() is the stage in front of it for responses that may be
+ * cached: the body is read into the tee buffer and written out from
+ * there, so keeping the copy costs no extra memcpy. As soon as the
+ * running size would cross the tee's limit the copy is dropped and
+ * the rest goes through relayBody(), so memory per connection stays
+ * bounded however large the response is.
+ */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "relay.h"
+
+#define RELAY_CHUNK (64 * 1024)  /* bytes per splice() or read() */
+
+static __thread int pipeFd[2] = { -1, -1 };
+static size_t relayChunk = RELAY_CHUNK; /* bytes in flight per splice() or read() */
+
+#define TEE_INITSIZE 8192       /* first allocation of a tee buffer */
+
+static ssize_t copyBody(int fromFd, int toFd, ssize_t len, ssize_t done);
+static int writeAll(int fd, const char* buf, size_t n);
+static int teeReserve(tee_t* tee, size_t n);
+static void resetPipe(void);
+
+/*
+ * relaySetLimit - cap the bytes one relay holds between reading from
+ *     the server and the client accepting them, 0 for the default.
+ *     Call before any relay starts.
+ */
+void relaySetLimit(size_t bytes)
+{
+    if (bytes > 0 && bytes < RELAY_CHUNK) {
+        relayChunk = bytes;
+    }
+}
+
+/*
+ * relayBody - move len bytes (or everything up to EOF if len < 0) from
+ *     fromFd to toFd. Returns the number of bytes relayed, or -1 on
+ *     error with errno set.
+ */
+ssize_t relayBody(int fromFd, int toFd, ssize_t len)
+{
+    ssize_t total = 0;
+
+    if (pipeFd[0] < 0) {
+        if (pipe(pipeFd) < 0) {
+            return copyBody(fromFd, toFd, len, 0);
+        }
+        fcntl(pipeFd[1], F_SETPIPE_SZ, (int)relayChunk); // 管道容量即在途数据上限
+    }
+
+    while (len < 0 || total < len) {
+        size_t want = relayChunk;
+        if (len >= 0 && (size_t)(len - total) < want) {
+            want = len - total;
+        }
+
+        ssize_t in = splice(fromFd, NULL, pipeFd[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (in < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EINVAL && total == 0) { // 描述符不支持 splice
+                return copyBody(fromFd, toFd, len, 0);
+            }
+            return -1;
+        }
+        if (in == 0) { // EOF
+            break;
+        }
+
+        while (in > 0) {
+            ssize_t out = splice(pipeFd[0], NULL, toFd, NULL, in, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (out < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                resetPipe(); // 管道中还残留数据, 不能再复用
+                return -1;
+            }
+            in -= out;
+            total += out;
+        }
+    }
+    return total;
+}
+
+/*
+ * relayTee - like relayBody(), but while tee still holds a copy every
+ *     byte relayed is appended to it. Returns the number of bytes
+ *     relayed, or -1 on error with errno set.
+ */
+ssize_t relayTee(int fromFd, int toFd, ssize_t len, tee_t* tee)
+{
+    ssize_t total = 0;
+
+    if (len >= 0 && tee->size + len > tee->limit) { // 事先知道放不下
+        teeAbandon(tee);
+    }
+
+    while (!tee->dropped && (len < 0 || total < len)) {
+        size_t want = relayChunk;
+        if (len >= 0 && (size_t)(len - total) < want) {
+            want = len - total;
+        }
+        if (tee->size + want > tee->limit) {
+            want = tee->limit - tee->size;
+        }
+        if (want == 0 || teeReserve(tee, want) < 0) { // 长度未知且已到上限
+            teeAbandon(tee);
+            break;
+        }
+
+        ssize_t in = read(fromFd, tee->buf + tee->size, want);
+        if (in < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (in == 0) {
+            return total;
+        }
+        if (writeAll(toFd, tee->buf + tee->size, in) < 0) {
+            return -1;
+        }
+        tee->size += in;
+        total += in;
+    }
+
+    if (len < 0 || total < len) {
+        ssize_t rest = relayBody(fromFd, toFd, len < 0 ? -1 : len - total);
+        if (rest < 0) {
+            return -1;
+        }
+        total += rest;
+    }
+    return total;
+}
+
+void teeInit(tee_t* tee, size_t limit)
+{
+    tee->size = 0;
+    tee->cap = 0;
+    tee->limit = limit;
+    tee->buf = NULL;
+    tee->dropped = 0;
+}
+
+/*
+ * teeAppend - copy n bytes into the tee. Abandons the copy if it would
+ *     grow past the limit. Returns 1 while the tee still holds a copy.
+ */
+int teeAppend(tee_t* tee, const void* data, size_t n)
+{
+    if (tee->dropped) {
+        return 0;
+    }
+    if (tee->size + n > tee->limit || teeReserve(tee, n) < 0) {
+        teeAbandon(tee);
+        return 0;
+    }
+    memcpy(tee->buf + tee->size, data, n);
+    tee->size += n;
+    return 1;
+}
+
+void teeAbandon(tee_t* tee)
+{
+    free(tee->buf);
+    tee->buf = NULL;
+    tee->size = tee->cap = 0;
+    tee->dropped = 1;
+}
+
+/* Make room for n more bytes, doubling up to the limit */
+static int teeReserve(tee_t* tee, size_t n)
+{
+    if (tee->size + n <= tee->cap) {
+        return 0;
+    }
+    size_t cap = tee->cap ? tee->cap : TEE_INITSIZE;
+    while (cap < tee->size + n) {
+        cap *= 2;
+    }
+    if (cap > tee->limit) {
+        cap = tee->limit;
+    }
+    char* buf = realloc(tee->buf, cap);
+    if (buf == NULL) {
+        return -1;
+    }
+    tee->buf = buf;
+    tee->cap = cap;
+    return 0;
+}
+
+static int writeAll(int fd, const char* buf, size_t n)
+{
+    while (n > 0) {
+        ssize_t out = write(fd, buf, n);
+        if (out < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += out;
+        n -= out;
+    }
+    return 0;
+}
+
+/* Fallback when splice() is not supported: large-buffer read/write */
+static ssize_t copyBody(int fromFd, int toFd, ssize_t len, ssize_t done)
+{
+    char buf[RELAY_CHUNK];
+
+    while (len < 0 || done < len) {
+        size_t want = relayChunk;
+        if (len >= 0 && (size_t)(len - done) < want) {
+            want = len - done;
+        }
+
+        ssize_t in = read(fromFd, buf, want);
+        if (in < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (in == 0) {
+            break;
+        }
+
+        if (writeAll(toFd, buf, in) < 0) {
+            return -1;
+        }
+        done += in;
+    }
+    return done;
+}
+
+static void resetPipe(void)
+{
+    close(pipeFd[0]);
+    close(pipeFd[1]);
+    pipeFd[0] = pipeFd[1] = -1;
+}
@@ -0,0 +1,30 @@
+/*
+ * relay.h - bulk copy of a response body from one socket to another,
+ *     optionally teeing a bounded copy aside for the cache
+ */
+#ifndef __RELAY_H__
+#define __RELAY_H__
+
+#include <sys/types.h>
+
+/*
+ * A copy of a response taken on its way to the client. It grows on
+ * demand up to limit bytes; past that the copy is dropped and the rest
+ * of the response is only streamed.
+ */
+typedef struct {
+    int dropped;                /* copy abandoned, buf freed */
+    char* buf;
+    size_t size;
+    size_t cap;
+    size_t limit;
+} tee_t;
+
+void relaySetLimit(size_t bytes);
+ssize_t relayBody(int fromFd, int toFd, ssize_t len);
+ssize_t relayTee(int fromFd, int toFd, ssize_t len, tee_t* tee);
+void teeInit(tee_t* tee, size_t limit);
+int teeAppend(tee_t* tee, const void* data, size_t n);
+void teeAbandon(tee_t* tee);
+
+#endif /* __RELAY_H__ */
@@ -0,0 +1,140 @@
+/*
+ * rlbench.c - rio_readlineb() against the byte-at-a-time version it
+ *     replaced
+ *
+ * Writes a file of request header lines, then reads it back line by
+ * line through a rio_t with each version and prints lines and bytes
+ * per second. The old rio_read() and rio_readlineb() are kept here as
+ * they were in csapp.c, renamed; they work on the same rio_t.
+ *
+ * usage: rlbench [megabytes]
+ */
+#include "csapp.h"
+
+#define DEFAULT_MB 64
+#define PASS_BYTES (1 << 20)        /* the file is read this much at a time */
+
+static const char* lines[] = {
+    "Host: www.example.com\r\n",
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n",
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n",
+    "Accept-Language: en-US,en;q=0.5\r\n",
+    "Cookie: session=0123456789abcdef0123456789abcdef; theme=dark; lang=en\r\n",
+    "Connection: keep-alive\r\n",
+    "\r\n",
+};
+#define NLINES (sizeof(lines) / sizeof(lines[0]))
+
+/* csapp.c's rio_read before rio_fill was split out, renamed */
+static ssize_t old_rio_read(rio_t *rp, char *usrbuf, size_t n)
+{
+    int cnt;
+
+    while (rp->rio_cnt <= 0) {  /* Refill if buf is empty */
+	rp->rio_cnt = read(rp->rio_fd, rp->rio_buf,
+			   sizeof(rp->rio_buf));
+	if (rp->rio_cnt < 0) {
+	    if (errno != EINTR) /* Interrupted by sig handler return */
+		return -1;
+	}
+	else if (rp->rio_cnt == 0)  /* EOF */
+	    return 0;
+	else
+	    rp->rio_bufptr = rp->rio_buf; /* Reset buffer ptr */
+    }
+
+    /* Copy min(n, rp->rio_cnt) bytes from internal buf to user buf */
+    cnt = n;
+    if (rp->rio_cnt < n)
+	cnt = rp->rio_cnt;
+    memcpy(usrbuf, rp->rio_bufptr, cnt);
+    rp->rio_bufptr += cnt;
+    rp->rio_cnt -= cnt;
+    return cnt;
+}
+
+/* csapp.c's byte-at-a-time rio_readlineb, renamed */
+static ssize_t old_rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
+{
+    int n, rc;
+    char c, *bufp = usrbuf;
+
+    for (n = 1; n < maxlen; n++) {
+        if ((rc = old_rio_read(rp, &c, 1)) == 1) {
+	    *bufp++ = c;
+	    if (c == '\n') {
+                n++;
+     		break;
+            }
+	} else if (rc == 0) {
+	    if (n == 1)
+		return 0; /* EOF, no data read */
+	    else
+		break;    /* EOF, some data was read */
+	} else
+	    return -1;	  /* Error */
+    }
+    *bufp = 0;
+    return n-1;
+}
+
+static long nowNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/* Read the file at fd passes times with readline; report the rate */
+static void run(const char* what, ssize_t (*readline)(rio_t*, void*, size_t),
+                int fd, int passes)
+{
+    char buf[MAXLINE];
+    rio_t rio;
+    long nLines = 0, bytes = 0;
+    ssize_t n;
+
+    long start = nowNs();
+    for (int p = 0; p < passes; p++) {
+        Lseek(fd, 0, SEEK_SET);
+        rio_readinitb(&rio, fd);
+        while ((n = readline(&rio, buf, MAXLINE)) > 0) {
+            nLines++;
+            bytes += n;
+        }
+    }
+    double secs = (nowNs() - start) / 1e9;
+    printf("  %-16s %8.2fM lines/s %8.0f MB/s\n", what, nLines / secs / 1e6, bytes / secs / 1e6);
+}
+
+int main(int argc, char** argv)
+{
+    int mb = argc > 1 ? atoi(argv[1]) : DEFAULT_MB;
+    char path[] = "/tmp/rlbenchXXXXXX";
+    char* data = Malloc(PASS_BYTES + MAXLINE);
+    size_t len = 0;
+
+    if (mb <= 0) {
+        fprintf(stderr, "usage: %s [megabytes]\n", argv[0]);
+        exit(1);
+    }
+    for (size_t i = 0; len < PASS_BYTES; i++) {
+        const char* l = lines[i % NLINES];
+        memcpy(data + len, l, strlen(l));
+        len += strlen(l);
+    }
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        unix_error("mkstemp error");
+    }
+    unlink(path);
+    Rio_writen(fd, data, len);
+    Free(data);
+
+    printf("rio_readlineb over %d MB of header lines\n", mb);
+    run("byte at a time", old_rio_readlineb, fd, mb / 16 > 0 ? mb / 16 : 1);
+    run("memchr", rio_readlineb, fd, mb);
+    Close(fd);
+    return 0;
+}
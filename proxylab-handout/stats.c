@@ -0,0 +1,223 @@
+/*
+ * stats.c - lock-free per-thread proxy counters and latency histograms
+ *
+ * Every thread that serves requests gets its own proxyStats_t the first
+ * time it records something. The owner is the only writer, so updates
+ * are a relaxed load and store with no lock and no shared cache line;
+ * statsResponse() sums all threads with relaxed loads. Only registering
+ * a new thread takes a mutex.
+ */
+#include "csapp.h"
+#include "stats.h"
+
+static proxyStats_t* allStats;
+static pthread_mutex_t statsLock = PTHREAD_MUTEX_INITIALIZER;
+static __thread proxyStats_t* myStats;
+
+static proxyStats_t* threadStats(void);
+static void bump(unsigned long* field, unsigned long n);
+static void histRecord(hist_t* h, long us);
+static int histIndex(unsigned long v);
+static unsigned long histValue(int idx);
+static void histMerge(hist_t* into, const hist_t* h);
+static unsigned long histPercentile(const hist_t* h, double p);
+static size_t appendHist(char* buf, size_t len, size_t cap, const char* name, const hist_t* h);
+
+/* statsNow - monotonic clock in microseconds */
+long statsNow(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+void statsAdd(int counter, unsigned long n)
+{
+    proxyStats_t* s = threadStats();
+
+    switch (counter) {
+    case STAT_REQUESTS:
+        bump(&s->requests, n);
+        break;
+    case STAT_BYTES_IN:
+        bump(&s->bytesIn, n);
+        break;
+    case STAT_BYTES_OUT:
+        bump(&s->bytesOut, n);
+        break;
+    case STAT_CACHE_HITS:
+        bump(&s->cacheHits, n);
+        break;
+    case STAT_CACHE_MISSES:
+        bump(&s->cacheMisses, n);
+        break;
+    case STAT_CONNECT_FAILURES:
+        bump(&s->connectFailures, n);
+        break;
+    case STAT_COALESCED:
+        bump(&s->coalesced, n);
+        break;
+    case STAT_REVALIDATED:
+        bump(&s->revalidated, n);
+        break;
+    }
+}
+
+/* statsLatency - record a whole request that started at startUs */
+void statsLatency(long startUs)
+{
+    histRecord(&threadStats()->latency, statsNow() - startUs);
+}
+
+/* statsTtfb - record the first upstream byte of a fetch started at startUs */
+void statsTtfb(long startUs)
+{
+    histRecord(&threadStats()->ttfb, statsNow() - startUs);
+}
+
+/*
+ * statsResponse - render a complete HTTP response with all counters in
+ *     a "name value" text format. Returns a Malloc'ed buffer.
+ */
+char* statsResponse(size_t* len)
+{
+    proxyStats_t total;
+    size_t cap = 4096;
+    size_t n;
+    char* body;
+
+    memset(&total, 0, sizeof(total));
+    pthread_mutex_lock(&statsLock);
+    for (proxyStats_t* s = allStats; s != NULL; s = s->next) {
+        total.requests += __atomic_load_n(&s->requests, __ATOMIC_RELAXED);
+        total.bytesIn += __atomic_load_n(&s->bytesIn, __ATOMIC_RELAXED);
+        total.bytesOut += __atomic_load_n(&s->bytesOut, __ATOMIC_RELAXED);
+        total.cacheHits += __atomic_load_n(&s->cacheHits, __ATOMIC_RELAXED);
+        total.cacheMisses += __atomic_load_n(&s->cacheMisses, __ATOMIC_RELAXED);
+        total.connectFailures += __atomic_load_n(&s->connectFailures, __ATOMIC_RELAXED);
+        total.coalesced += __atomic_load_n(&s->coalesced, __ATOMIC_RELAXED);
+        total.revalidated += __atomic_load_n(&s->revalidated, __ATOMIC_RELAXED);
+        histMerge(&total.latency, &s->latency);
+        histMerge(&total.ttfb, &s->ttfb);
+    }
+    pthread_mutex_unlock(&statsLock);
+
+    body = Malloc(cap);
+    n = snprintf(body, cap,
+                 "proxy_requests_total %lu\n"
+                 "proxy_bytes_in_total %lu\n"
+                 "proxy_bytes_out_total %lu\n"
+                 "proxy_cache_hits_total %lu\n"
+                 "proxy_cache_misses_total %lu\n"
+                 "proxy_upstream_connect_failures_total %lu\n"
+                 "proxy_coalesced_total %lu\n"
+                 "proxy_revalidated_total %lu\n",
+                 total.requests, total.bytesIn, total.bytesOut, total.cacheHits,
+                 total.cacheMisses, total.connectFailures, total.coalesced,
+                 total.revalidated);
+    n = appendHist(body, n, cap, "proxy_request_latency_us", &total.latency);
+    n = appendHist(body, n, cap, "proxy_upstream_ttfb_us", &total.ttfb);
+
+    char* resp = Malloc(n + 128);
+    *len = sprintf(resp, "HTTP/1.0 200 OK\r\n"
+                   "Content-Type: text/plain\r\n"
+                   "Content-Length: %zu\r\n\r\n", n);
+    memcpy(resp + *len, body, n);
+    *len += n;
+    Free(body);
+    return resp;
+}
+
+static proxyStats_t* threadStats(void)
+{
+    if (myStats == NULL) {
+        myStats = Calloc(1, sizeof(proxyStats_t));
+        pthread_mutex_lock(&statsLock);
+        myStats->next = allStats;
+        allStats = myStats;
+        pthread_mutex_unlock(&statsLock);
+    }
+    return myStats;
+}
+
+/* Single writer: a relaxed load and store, no locked instruction */
+static void bump(unsigned long* field, unsigned long n)
+{
+    __atomic_store_n(field, __atomic_load_n(field, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static void histRecord(hist_t* h, long us)
+{
+    if (us < 0) {
+        us = 0;
+    }
+    bump(&h->count, 1);
+    bump(&h->sum, us);
+    bump(&h->bucket[histIndex(us)], 1);
+}
+
+static int histIndex(unsigned long v)
+{
+    if (v < HIST_SUB) {
+        return v;
+    }
+    if (v >= 1UL << HIST_MAX_EXP) {
+        v = (1UL << HIST_MAX_EXP) - 1;
+    }
+    int exp = 63 - __builtin_clzl(v); // v 的最高位
+    int sub = (v >> (exp - HIST_SUB_BITS)) & (HIST_SUB - 1);
+    return (exp - HIST_SUB_BITS + 1) * HIST_SUB + sub;
+}
+
+/* Lower bound of the values that land in bucket idx */
+static unsigned long histValue(int idx)
+{
+    if (idx < HIST_SUB) {
+        return idx;
+    }
+    int exp = idx / HIST_SUB + HIST_SUB_BITS - 1;
+    int sub = idx % HIST_SUB;
+    return (unsigned long)(HIST_SUB + sub) << (exp - HIST_SUB_BITS);
+}
+
+static void histMerge(hist_t* into, const hist_t* h)
+{
+    into->count += __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+    into->sum += __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        into->bucket[i] += __atomic_load_n(&h->bucket[i], __ATOMIC_RELAXED);
+    }
+}
+
+static unsigned long histPercentile(const hist_t* h, double p)
+{
+    unsigned long total = 0;
+    unsigned long want = (unsigned long)(p * h->count + 0.5);
+
+    if (want == 0) {
+        want = 1;
+    }
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        total += h->bucket[i];
+        if (total >= want) {
+            return histValue(i);
+        }
+    }
+    return 0;
+}
+
+static size_t appendHist(char* buf, size_t len, size_t cap, const char* name, const hist_t* h)
+{
+    static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+    for (int i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]) && len < cap; i++) {
+        len += snprintf(buf + len, cap - len, "%s{quantile=\"%g\"} %lu\n",
+                        name, quantiles[i], h->count ? histPercentile(h, quantiles[i]) : 0);
+    }
+    if (len < cap) {
+        len += snprintf(buf + len, cap - len, "%s_count %lu\n%s_sum %lu\n",
+                        name, h->count, name, h->sum);
+    }
+    return len < cap ? len : cap - 1;
+}
@@ -0,0 +1,52 @@
+/*
+ * stats.h - lock-free per-thread proxy counters and latency histograms
+ */
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include "csapp.h"
+
+#define STATS_URL "/__proxy_stats" /* origin-form request that returns the stats */
+
+/*
+ * Log-linear (HDR style) histogram of microseconds: values below
+ * HIST_SUB are exact, above that every power of two is split into
+ * HIST_SUB linear buckets, so the relative error stays under 1/HIST_SUB.
+ */
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_EXP 40         /* values are clamped to 2^40 us */
+#define HIST_BUCKETS ((HIST_MAX_EXP - HIST_SUB_BITS + 2) * HIST_SUB)
+
+typedef struct {
+    unsigned long count;
+    unsigned long sum;
+    unsigned long bucket[HIST_BUCKETS];
+} hist_t;
+
+/* One per thread; only the owning thread writes it */
+typedef struct proxyStats {
+    unsigned long requests;
+    unsigned long bytesIn;          /* response bytes read from origins */
+    unsigned long bytesOut;         /* response bytes written to clients */
+    unsigned long cacheHits;
+    unsigned long cacheMisses;
+    unsigned long connectFailures;  /* upstream DNS or connect failed */
+    unsigned long coalesced;        /* hits served after waiting on another miss */
+    unsigned long revalidated;      /* stale objects the origin confirmed with 304 */
+    hist_t latency;                 /* request line to response done */
+    hist_t ttfb;                    /* upstream connect to first response byte */
+    struct proxyStats* next;
+} proxyStats_t;
+
+enum { STAT_REQUESTS, STAT_BYTES_IN, STAT_BYTES_OUT, STAT_CACHE_HITS,
+       STAT_CACHE_MISSES, STAT_CONNECT_FAILURES, STAT_COALESCED,
+       STAT_REVALIDATED };
+
+long statsNow(void);
+void statsAdd(int counter, unsigned long n);
+void statsLatency(long startUs);
+void statsTtfb(long startUs);
+char* statsResponse(size_t* len);
+
+#endif /* __STATS_H__ */
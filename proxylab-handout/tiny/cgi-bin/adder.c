@@ -1,38 +1,63 @@
 /*
  * adder.c - a minimal CGI program that adds two numbers together
+ *
+ *     Run as "adder -pool" by tiny -c, it stays alive and answers one
+ *     request per message on the SOCK_SEQPACKET socket that is its stdin.
  */
 /* $begin adder */
 #include "csapp.h"
 
-int main(void) {
-    char *buf, *p;
+int respond(char *query, char *out);
+
+int main(int argc, char **argv) {
+    char query[MAXLINE], out[MAXBUF];
+    int n;
+
+    if (argc > 1 && !strcmp(argv[1], "-pool")) {
+	/* One request in, one response out, until tiny closes the socket */
+	while ((n = recv(STDIN_FILENO, query, MAXLINE - 1, 0)) >= 0) {
+	    if (n == 0) /* Closed; a request always holds at least its NUL */
+		break;
+	    query[n] = '\0';  /* Already there unless the query was cut short */
+	    n = respond(query, out);
+	    if (send(STDIN_FILENO, out, n, 0) < 0)
+		break;
+	}
+	exit(0);
+    }
+
+    n = respond(getenv("QUERY_STRING"), out);
+    fwrite(out, 1, n, stdout);
+    fflush(stdout);
+
+    exit(0);
+}
+
+/* respond - build the whole CGI output for query in out */
+int respond(char *query, char *out) {
+    char *p;
     char arg1[MAXLINE], arg2[MAXLINE], content[MAXLINE];
     int n1=0, n2=0;
 
     /* Extract the two arguments */
-    if ((buf = getenv("QUERY_STRING")) != NULL) {
-	p = strchr(buf, '&');
+    if (query != NULL && (p = strchr(query, '&')) != NULL) {
 	*p = '\0';
-	strcpy(arg1, buf);
+	strcpy(arg1, query);
 	strcpy(arg2, p+1);
 	n1 = atoi(arg1);
 	n2 = atoi(arg2);
     }
 
     /* Make the response body */
-    sprintf(content, "Welcome to add.com: ");
-    sprintf(content, "%sTHE Internet addition portal.\r\n<p>", content);
-    sprintf(content, "%sThe answer is: %d + %d = %d\r\n<p>", 
-	    content, n1, n2, n1 + n2);
-    sprintf(content, "%sThanks for visiting!\r\n", content);
-  
-    /* Generate the HTTP response */
-    printf("Connection: close\r\n");
-    printf("Content-length: %d\r\n", (int)strlen(content));
-    printf("Content-type: text/html\r\n\r\n");
-    printf("%s", content);
-    fflush(stdout);
+    sprintf(content, "Welcome to add.com: "
+	    "THE Internet addition portal.\r\n<p>"
+	    "The answer is: %d + %d = %d\r\n<p>"
+	    "Thanks for visiting!\r\n", n1, n2, n1 + n2);
 
-    exit(0);
+    /* Generate the HTTP response */
+    return sprintf(out, "Connection: close\r\n"
+		   "Content-length: %d\r\n"
+		   "Content-type: text/html\r\n\r\n"
+		   "%s", (int)strlen(content), content);
 }
 /* $end adder */
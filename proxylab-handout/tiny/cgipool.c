@@ -0,0 +1,112 @@
+/*
+ * cgipool.c - pools of long-lived CGI workers, one pool per program,
+ *     started on the program's first request. A request takes an idle
+ *     worker from the pool's sbuf, so dynamic requests are spread over
+ *     the workers and wait only when all of them are busy.
+ */
+/* $begin cgipoolc */
+#include "cgipool.h"
+
+static cgipool_t pools[CGIPOOL_MAX];
+static int npools;
+static int nworkers;         /* Workers per pool, 0 if pools are off */
+static sem_t mutex;          /* Protects pools and npools */
+
+static cgipool_t *find_pool(char *filename);
+static int spawn(cgipool_t *pp, int i);
+
+void cgipool_init(int n)
+{
+    nworkers = n;
+    Sem_init(&mutex, 0, 1);
+}
+
+/*
+ * cgipool_run - run filename with cgiargs on a pooled worker and store
+ *     its output in out (CGI_MAXMSG bytes). Returns the output length,
+ *     or -1 if pools are off or the worker failed or took longer than
+ *     CGI_TIMEOUT seconds; the caller then falls back to fork and exec.
+ */
+int cgipool_run(char *filename, char *cgiargs, char *out)
+{
+    cgipool_t *pp;
+    int i;
+    ssize_t n = -1;
+
+    if (nworkers == 0 || (pp = find_pool(filename)) == NULL)
+        return -1;
+
+    i = sbuf_remove(&pp->idle);          /* Wait for an idle worker */
+    if (pp->fd[i] >= 0 && send(pp->fd[i], cgiargs, strlen(cgiargs) + 1, 0) >= 0) {
+        while ((n = recv(pp->fd[i], out, CGI_MAXMSG, 0)) < 0 && errno == EINTR)
+            ;
+    }
+    if (n <= 0) { /* Worker died or hung: replace it for the next request */
+        n = -1;
+        if (pp->fd[i] >= 0) {
+            close(pp->fd[i]);
+            kill(pp->pid[i], SIGKILL);
+            Waitpid(pp->pid[i], NULL, 0);
+        }
+        spawn(pp, i);
+    }
+    sbuf_insert(&pp->idle, i);
+    return n;
+}
+
+/* Return the pool for filename, starting its workers on first use */
+static cgipool_t *find_pool(char *filename)
+{
+    cgipool_t *pp = NULL;
+    int i;
+
+    P(&mutex);
+    for (i = 0; i < npools; i++) {
+        if (!strcmp(pools[i].filename, filename)) {
+            pp = &pools[i];
+            break;
+        }
+    }
+    if (pp == NULL && npools < CGIPOOL_MAX) {
+        pp = &pools[npools++];
+        pp->filename = Malloc(strlen(filename) + 1);
+        strcpy(pp->filename, filename);
+        pp->n = nworkers;
+        pp->fd = Malloc(nworkers * sizeof(int));
+        pp->pid = Malloc(nworkers * sizeof(pid_t));
+        sbuf_init(&pp->idle, nworkers);
+        for (i = 0; i < nworkers; i++) {
+            spawn(pp, i);
+            sbuf_insert(&pp->idle, i);
+        }
+    }
+    V(&mutex);
+    return pp;
+}
+
+/*
+ * spawn - start worker i of pp. On failure fd[i] is -1 and requests
+ *     given that worker fall back to fork and exec.
+ */
+static int spawn(cgipool_t *pp, int i)
+{
+    int sv[2];
+    char *argv[] = { pp->filename, "-pool", NULL };
+    struct timeval tv = { CGI_TIMEOUT, 0 };
+
+    pp->fd[i] = -1;
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0)
+        return -1;
+    if ((pp->pid[i] = Fork()) == 0) { /* Child */
+        Dup2(sv[1], STDIN_FILENO);     /* Requests arrive on stdin */
+        closefrom(STDERR_FILENO + 1);  /* Don't hold client connections open */
+        Execve(pp->filename, argv, environ);
+    }
+    close(sv[1]);
+    /* A hung worker fails send() or recv() with EAGAIN instead of blocking forever */
+    setsockopt(sv[0], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(sv[0], SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    pp->fd[i] = sv[0];
+    return 0;
+}
+/* $end cgipoolc */
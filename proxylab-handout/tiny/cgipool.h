@@ -0,0 +1,35 @@
+/*
+ * cgipool.h - pools of long-lived CGI workers (tiny -c N)
+ *
+ *     A worker is the CGI program started once with the argument
+ *     "-pool" and a SOCK_SEQPACKET UNIX socket as its stdin. Each
+ *     request is one message holding QUERY_STRING and its NUL, so even
+ *     an empty query is never a zero-length message, which a worker
+ *     could not tell from tiny closing the socket. The worker answers
+ *     with one message holding everything it would have written to
+ *     stdout as a plain CGI program.
+ */
+#ifndef __CGIPOOL_H__
+#define __CGIPOOL_H__
+
+#include "csapp.h"
+#include "sbuf.h"
+
+#define CGIPOOL_MAX 16       /* Distinct CGI programs with a pool */
+#define CGI_MAXMSG 65536     /* Largest response a worker may send */
+#define CGI_TIMEOUT 30       /* Seconds a worker may take to answer */
+
+/* $begin cgipoolt */
+typedef struct {
+    char *filename;          /* CGI program the workers run */
+    int n;                   /* Number of workers */
+    int *fd;                 /* fd[i] talks to worker i */
+    pid_t *pid;              /* pid[i] is worker i */
+    sbuf_t idle;             /* Indexes of workers waiting for a request */
+} cgipool_t;
+/* $end cgipoolt */
+
+void cgipool_init(int nworkers);
+int cgipool_run(char *filename, char *cgiargs, char *out);
+
+#endif /* __CGIPOOL_H__ */
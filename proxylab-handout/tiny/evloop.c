@@ -0,0 +1,337 @@
+/*
+ * evloop.c - single-threaded, edge-triggered epoll core for tiny -e
+ *
+ *     Each connection is a conn_t that alternates between two states:
+ *     READ collects a request head without blocking, WRITE sends the
+ *     response set up by static_response() in tiny.c: a few iovecs and
+ *     then, for files not held in memory, the body with sendfile().
+ *     Bytes after the head stay in the buffer, so pipelined requests
+ *     are served in order; a malformed or oversized head is answered
+ *     with 400 or 431 and the connection closed. Descriptors are
+ *     registered once for both directions with EPOLLET; a handler
+ *     always runs until EAGAIN, and a state change runs the new
+ *     state's handler at once, since its edge may already have passed. An idle connection costs a conn_t
+ *     and its request buffer.
+ *
+ *     CGI requests still run on a blocking socket, from the loop
+ *     itself, and close the connection (use -c to keep them short).
+ */
+/* $begin evloopc */
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#include "tiny.h"
+
+#define MAXEVENTS 256
+#define REQ_INITSIZE 1024  /* Request buffer grows up to MAXBUF */
+
+enum { READ, WRITE };
+
+typedef struct conn {
+    int fd;
+    int state;             /* READ or WRITE */
+    char *req;             /* Request bytes read but not yet served */
+    size_t reqlen;
+    size_t reqsize;
+    http_req_t head;       /* Parse of the request head in req so far */
+    resp_t resp;           /* Response being sent */
+    fdent_t *ep;           /* File being sent, or NULL */
+    int keep;              /* Connection stays open after this response */
+    time_t lastactive;     /* Last time bytes moved, for the idle sweep */
+    struct conn *prev;     /* List of open connections */
+    struct conn *next;
+} conn_t;
+
+static int epfd;
+static conn_t *conns;
+
+static void accept_all(int listenfd);
+static void do_read(conn_t *c);
+static int do_write(conn_t *c);
+static int handle_request(conn_t *c, char *end);
+static void reply_error(conn_t *c, char *cause, char *errnum,
+                        char *shortmsg, char *longmsg);
+static void reject_head(conn_t *c, int rc);
+static void sweep(time_t now);
+static void close_conn(conn_t *c);
+
+/*
+ * event_loop - serve every connection accepted on listenfd from this
+ *     thread. Never returns.
+ */
+void event_loop(int listenfd)
+{
+    struct epoll_event ev, events[MAXEVENTS];
+    struct rlimit rl;
+    time_t lastsweep = time(NULL), now;
+    int i, n;
+
+    /* Every connection is a descriptor; take all we are allowed */
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    if ((epfd = epoll_create1(0)) < 0)
+        unix_error("epoll_create1 error");
+    fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL;    /* NULL marks the listening socket */
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &ev) < 0)
+        unix_error("epoll_ctl error");
+
+    while (1) {
+        if ((n = epoll_wait(epfd, events, MAXEVENTS, 1000)) < 0) {
+            if (errno == EINTR)
+                continue;
+            unix_error("epoll_wait error");
+        }
+        now = time(NULL);
+        for (i = 0; i < n; i++) {
+            conn_t *c = events[i].data.ptr;
+            if (c == NULL) {
+                accept_all(listenfd);
+                continue;
+            }
+            c->lastactive = now;
+            if (c->state == READ || do_write(c)) /* Either may free c */
+                do_read(c);
+        }
+        if (now != lastsweep) {
+            sweep(now);
+            lastsweep = now;
+        }
+    }
+}
+
+static void accept_all(int listenfd)
+{
+    struct epoll_event ev;
+    conn_t *c;
+    int connfd;
+
+    while ((connfd = accept(listenfd, NULL, NULL)) >= 0) {
+        fcntl(connfd, F_SETFL, fcntl(connfd, F_GETFL) | O_NONBLOCK);
+        c = Calloc(1, sizeof(conn_t));
+        c->fd = connfd;
+        c->state = READ;
+        c->reqsize = REQ_INITSIZE;
+        c->req = Malloc(c->reqsize);
+        http_init(&c->head);
+        c->lastactive = time(NULL);
+        if ((c->next = conns) != NULL)
+            conns->prev = c;
+        conns = c;
+
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = c;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, connfd, &ev) < 0)
+            unix_error("epoll_ctl error");
+        do_read(c); /* The request may already be here */
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        fprintf(stderr, "accept error: %s\n", strerror(errno));
+}
+
+/* READ: serve every complete request head, then read until EAGAIN */
+static void do_read(conn_t *c)
+{
+    ssize_t n;
+
+    while (1) {
+        n = http_parse_request(&c->head, c->req, c->reqlen);
+        if (n == HTTP_BAD || n == HTTP_NOMEM) {
+            reject_head(c, n);
+            return;
+        }
+        if (n > 0) {
+            if (handle_request(c, c->req + n) < 0 || !do_write(c))
+                return;  /* Closed, or waiting to write */
+            continue;    /* Look for a pipelined request */
+        }
+        if (c->reqlen == c->reqsize - 1) {
+            if (c->reqsize == MAXBUF) { /* Request head too long */
+                reject_head(c, HTTP_NOMEM);
+                return;
+            }
+            c->reqsize = c->reqsize * 2 > MAXBUF ? MAXBUF : c->reqsize * 2;
+            c->req = Realloc(c->req, c->reqsize);
+        }
+        n = read(c->fd, c->req + c->reqlen, c->reqsize - 1 - c->reqlen);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (n <= 0) {
+            close_conn(c);
+            return;
+        }
+        c->reqlen += n;
+    }
+}
+
+/*
+ * handle_request - set up the response to the request head that ends
+ *     at end and drop the head from the buffer. Returns 0 with c in
+ *     WRITE, or -1 if the connection was closed.
+ */
+static int handle_request(conn_t *c, char *end)
+{
+    char filename[MAXLINE], cgiargs[MAXLINE];
+    char *method, *uri;
+    int http11;
+    reqhdrs_t hdrs;
+    struct stat sbuf;
+
+    fwrite(c->req, 1, end - c->req, stdout);
+    method = http_span_str(c->req, c->head.method);
+    uri = http_span_str(c->req, c->head.uri);
+    http11 = c->head.minor == 1;
+    hdrs.keep = http11;
+    hdrs.gzip = 0;
+    hdrs.nranges = 0;
+    request_headers(c->req, &c->head, &hdrs);
+    http_free(&c->head);
+    hdrs.keep = hdrs.keep && persistent;
+    c->keep = hdrs.keep;
+    c->ep = NULL;
+
+    if (strcasecmp(method, "GET")) {
+        reply_error(c, method, "501", "Not Implemented",
+                    "Tiny does not implement this method");
+    }
+    else if (c->head.uri.len > MAXLINE - 16) {
+        reply_error(c, "", "414", "URI Too Long",
+                    "Tiny does not take URIs this long");
+    }
+    else if (parse_uri(uri, filename, cgiargs)) { /* Static content */
+        if ((c->ep = fdcache_open(filename)) != NULL
+            && (S_IRUSR & c->ep->sbuf.st_mode)) {
+            static_response(&c->resp, c->ep, http11, &hdrs);
+        }
+        else if (stat(filename, &sbuf) < 0) {
+            reply_error(c, filename, "404", "Not found",
+                        "Tiny couldn't find this file");
+        }
+        else {
+            reply_error(c, filename, "403", "Forbidden",
+                        "Tiny couldn't read the file");
+        }
+    }
+    else { /* Dynamic content: hand the socket over, blocking */
+        fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) & ~O_NONBLOCK);
+        if (stat(filename, &sbuf) < 0)
+            clienterror(c->fd, filename, "404", "Not found",
+                        "Tiny couldn't find this file");
+        else if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode))
+            clienterror(c->fd, filename, "403", "Forbidden",
+                        "Tiny couldn't run the CGI program");
+        else
+            serve_dynamic(c->fd, filename, cgiargs);
+        close_conn(c);
+        return -1;
+    }
+
+    /* Keep any pipelined bytes after this head */
+    c->reqlen -= end - c->req;
+    memmove(c->req, end, c->reqlen);
+    http_init(&c->head);
+    c->state = WRITE;
+    return 0;
+}
+
+/* Answer with an error response and close after it */
+static void reply_error(conn_t *c, char *cause, char *errnum,
+                        char *shortmsg, char *longmsg)
+{
+    if (c->ep != NULL) {
+        fdcache_close(c->ep);
+        c->ep = NULL;
+    }
+    memset(&c->resp, 0, sizeof(resp_t));
+    c->resp.buf = Malloc(MAXBUF);
+    c->resp.iov[0].iov_base = c->resp.buf;
+    c->resp.iov[0].iov_len = error_response(c->resp.buf, cause, errnum,
+                                            shortmsg, longmsg);
+    c->resp.iovcnt = 1;
+    c->keep = 0;
+}
+
+/*
+ * reject_head - the head in c->req is malformed (HTTP_BAD) or too big
+ *     (HTTP_NOMEM): send 400 or 431 from WRITE, then close
+ */
+static void reject_head(conn_t *c, int rc)
+{
+    char drain[MAXLINE];
+
+    /* Unread bytes at close() would reset the connection, reply and all */
+    while (read(c->fd, drain, sizeof(drain)) > 0)
+        ;
+    if (rc == HTTP_BAD)
+        reply_error(c, "", "400", "Bad Request",
+                    "Tiny could not parse the request");
+    else
+        reply_error(c, "", "431", "Request Header Fields Too Large",
+                    "Tiny does not take request heads this long");
+    c->reqlen = 0;  /* Nothing after a bad head can be trusted */
+    c->state = WRITE;
+    do_write(c);
+}
+
+/*
+ * do_write - WRITE: send the rest of the response. Returns 1 once it
+ *     is done and c is back in READ, 0 if it must wait for the client
+ *     or was closed.
+ */
+static int do_write(conn_t *c)
+{
+    int rc;
+
+    if ((rc = send_response(c->fd, &c->resp)) <= 0) {
+        if (rc < 0) /* Client went away, or the file shrank */
+            close_conn(c);
+        return 0;
+    }
+    if (!c->keep) {
+        close_conn(c);
+        return 0;
+    }
+    if (c->ep != NULL) {
+        fdcache_close(c->ep);
+        c->ep = NULL;
+    }
+    free_response(&c->resp);
+    c->state = READ;
+    return 1;
+}
+
+/* Close connections that moved no bytes for KEEPALIVE_TIMEOUT seconds */
+static void sweep(time_t now)
+{
+    conn_t *c, *next;
+
+    for (c = conns; c != NULL; c = next) {
+        next = c->next;
+        if (now - c->lastactive >= KEEPALIVE_TIMEOUT)
+            close_conn(c);
+    }
+}
+
+static void close_conn(conn_t *c)
+{
+    close(c->fd); /* Also removes it from the epoll set */
+    if (c->ep != NULL)
+        fdcache_close(c->ep);
+    free_response(&c->resp);
+    if (c->prev != NULL)
+        c->prev->next = c->next;
+    else
+        conns = c->next;
+    if (c->next != NULL)
+        c->next->prev = c->prev;
+    Free(c->req);
+    http_free(&c->head);
+    Free(c);
+}
+/* $end evloopc */
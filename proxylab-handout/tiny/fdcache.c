@@ -0,0 +1,287 @@
+/*
+ * fdcache.c - small LRU cache of static files.
+ *
+ *     A hit skips open() and stat(); the stat result is rechecked
+ *     against the path at most every FDCACHE_CHECK seconds, so an
+ *     edited or replaced file is picked up. Readers share the
+ *     descriptor since sendfile() is given an explicit offset.
+ *
+ *     Every entry carries its response headers, rendered once. Under
+ *     a memory budget, files up to ASSET_MAX are read in whole and
+ *     the descriptor closed, so a hit is answered from memory; a
+ *     filename.gz at least as new as the file is loaded next to it
+ *     for clients that accept gzip.
+ */
+/* $begin fdcachec */
+#include "fdcache.h"
+#include "tiny.h"
+
+static fdent_t *table[FDCACHE_SIZE];
+static unsigned long lruclock; /* Bumped on every hit */
+static size_t memmax;          /* Budget for file contents, 0 if none */
+static size_t memused;
+static sem_t mutex;            /* Protects table, lruclock, memused and refcnt */
+
+static void load(fdent_t *ep);
+static char *read_file(int fd, off_t size);
+static int reserve(size_t n);
+static void unreserve(size_t n);
+static char *render_hdrs(fdent_t *ep, off_t size, int gzip, int *len);
+static int changed(fdent_t *ep);
+static void drop(int i);
+static void destroy(fdent_t *ep);
+
+void fdcache_init(size_t max)
+{
+    memmax = max;
+    Sem_init(&mutex, 0, 1);
+}
+
+/* fdcache_preload - bring the regular files in dir into the cache */
+void fdcache_preload(char *dir)
+{
+    DIR *dp;
+    struct dirent *de;
+    char path[MAXLINE];
+    fdent_t *ep;
+    size_t len;
+    int n = 0;
+
+    if ((dp = opendir(dir)) == NULL)
+        return;
+    while ((de = readdir(dp)) != NULL && n < FDCACHE_SIZE) {
+        len = strlen(de->d_name);
+        if (de->d_name[0] == '.' || (len > 3 && !strcmp(de->d_name + len - 3, ".gz")))
+            continue; /* Hidden, or a variant loaded with its file */
+        snprintf(path, MAXLINE, "%s/%s", dir, de->d_name);
+        if ((ep = fdcache_open(path)) != NULL) {
+            fdcache_close(ep);
+            n++;
+        }
+    }
+    closedir(dp);
+}
+
+/*
+ * fdcache_open - return an entry for the regular file filename with
+ *     one reference held, or NULL with errno set if it cannot be opened
+ */
+fdent_t *fdcache_open(char *filename)
+{
+    int i, fd, victim = -1;
+    fdent_t *ep;
+    struct stat sbuf;
+    time_t now = time(NULL);
+
+    P(&mutex);
+    for (i = 0; i < FDCACHE_SIZE; i++) {
+        if ((ep = table[i]) == NULL || strcmp(ep->filename, filename))
+            continue;
+        if (now - ep->checked >= FDCACHE_CHECK) { /* Has the file changed? */
+            if (changed(ep)) {
+                drop(i);
+                break;
+            }
+            ep->checked = now;
+        }
+        ep->refcnt++;
+        ep->lastuse = ++lruclock;
+        V(&mutex);
+        return ep;
+    }
+    V(&mutex);
+
+    /* Miss: open and load outside the lock */
+    if ((fd = open(filename, O_RDONLY, 0)) < 0)
+        return NULL;
+    if (fstat(fd, &sbuf) < 0 || !S_ISREG(sbuf.st_mode)) {
+        close(fd);
+        errno = EACCES;
+        return NULL;
+    }
+    ep = Calloc(1, sizeof(fdent_t));
+    ep->filename = Malloc(strlen(filename) + 1);
+    strcpy(ep->filename, filename);
+    ep->fd = fd;
+    ep->sbuf = sbuf;
+    ep->checked = now;
+    ep->refcnt = 1;
+    load(ep);
+    ep->hdrs = render_hdrs(ep, ep->sbuf.st_size, 0, &ep->hdrlen);
+
+    P(&mutex);
+    for (i = 0; i < FDCACHE_SIZE; i++) {
+        if (table[i] == NULL) {
+            victim = i;
+            break;
+        }
+        if (!strcmp(table[i]->filename, filename)) { /* Another thread won */
+            victim = -1;
+            break;
+        }
+        if (victim < 0 || table[i]->lastuse < table[victim]->lastuse)
+            victim = i;
+    }
+    if (victim >= 0) {
+        if (table[victim] != NULL)
+            drop(victim);
+        table[victim] = ep;
+        ep->cached = 1;
+        ep->lastuse = ++lruclock;
+    }
+    V(&mutex);
+    return ep; /* Uncached entries are closed by fdcache_close */
+}
+
+/* fdcache_close - give back the reference taken by fdcache_open */
+void fdcache_close(fdent_t *ep)
+{
+    P(&mutex);
+    if (--ep->refcnt == 0 && !ep->cached)
+        destroy(ep);
+    V(&mutex);
+}
+
+/* Read the file, and its .gz variant, into memory if the budget allows */
+static void load(fdent_t *ep)
+{
+    char gzname[MAXLINE];
+    struct stat sbuf;
+    int fd;
+
+    if (memmax == 0)
+        return;
+    if (ep->sbuf.st_size <= ASSET_MAX && reserve(ep->sbuf.st_size)) {
+        if ((ep->data = read_file(ep->fd, ep->sbuf.st_size)) != NULL) {
+            close(ep->fd);
+            ep->fd = -1;
+        }
+        else
+            unreserve(ep->sbuf.st_size);
+    }
+
+    snprintf(gzname, MAXLINE, "%s.gz", ep->filename);
+    if (ep->data != NULL && (fd = open(gzname, O_RDONLY, 0)) >= 0) {
+        if (fstat(fd, &sbuf) == 0 && S_ISREG(sbuf.st_mode)
+            && sbuf.st_mtime >= ep->sbuf.st_mtime /* Not left over from an old file */
+            && sbuf.st_size <= ASSET_MAX && reserve(sbuf.st_size)) {
+            if ((ep->gzdata = read_file(fd, sbuf.st_size)) != NULL) {
+                ep->gzsize = sbuf.st_size;
+                ep->gzmtime = sbuf.st_mtime;
+                ep->gzhdrs = render_hdrs(ep, ep->gzsize, 1, &ep->gzhdrlen);
+            }
+            else
+                unreserve(sbuf.st_size);
+        }
+        close(fd);
+    }
+}
+
+/* Read size bytes from the start of fd into a new buffer, NULL on error */
+static char *read_file(int fd, off_t size)
+{
+    char *buf = Malloc(size > 0 ? size : 1);
+    off_t off = 0;
+    ssize_t n;
+
+    while (off < size) {
+        if ((n = pread(fd, buf + off, size - off, off)) <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            Free(buf);
+            return NULL;
+        }
+        off += n;
+    }
+    return buf;
+}
+
+/* Take n bytes of the memory budget; 1 if granted */
+static int reserve(size_t n)
+{
+    int ok = 0;
+
+    P(&mutex);
+    if (memused + n <= memmax) {
+        memused += n;
+        ok = 1;
+    }
+    V(&mutex);
+    return ok;
+}
+
+static void unreserve(size_t n)
+{
+    P(&mutex);
+    memused -= n;
+    V(&mutex);
+}
+
+/*
+ * render_hdrs - the headers that follow the status and Connection lines
+ *     when sending size bytes of ep, or of its gzip variant
+ */
+static char *render_hdrs(fdent_t *ep, off_t size, int gzip, int *len)
+{
+    char filetype[MAXLINE], buf[MAXBUF], *hdrs;
+
+    get_filetype(ep->filename, filetype);
+    *len = snprintf(buf, MAXBUF, "Server: Tiny Web Server\r\n"
+                    "Accept-Ranges: bytes\r\n"
+                    "Content-length: %lld\r\n"
+                    "Content-type: %s\r\n%s%s\r\n",
+                    (long long)size, filetype,
+                    gzip ? "Content-Encoding: gzip\r\n" : "",
+                    ep->gzdata != NULL ? "Vary: Accept-Encoding\r\n" : "");
+    hdrs = Malloc(*len + 1);
+    memcpy(hdrs, buf, *len + 1);
+    return hdrs;
+}
+
+/* Has the file, or its loaded .gz variant, changed on disk? */
+static int changed(fdent_t *ep)
+{
+    char gzname[MAXLINE];
+    struct stat sbuf;
+
+    if (stat(ep->filename, &sbuf) < 0 || sbuf.st_ino != ep->sbuf.st_ino
+        || sbuf.st_dev != ep->sbuf.st_dev || sbuf.st_size != ep->sbuf.st_size
+        || sbuf.st_mtime != ep->sbuf.st_mtime)
+        return 1;
+    if (ep->gzdata == NULL)
+        return 0;
+    snprintf(gzname, MAXLINE, "%s.gz", ep->filename);
+    return stat(gzname, &sbuf) < 0 || sbuf.st_size != ep->gzsize
+        || sbuf.st_mtime != ep->gzmtime;
+}
+
+/* Remove table[i]; it is freed once the last reader is done. Mutex held. */
+static void drop(int i)
+{
+    fdent_t *ep = table[i];
+
+    table[i] = NULL;
+    ep->cached = 0;
+    if (ep->refcnt == 0)
+        destroy(ep);
+}
+
+/* Mutex held */
+static void destroy(fdent_t *ep)
+{
+    if (ep->fd >= 0)
+        close(ep->fd);
+    if (ep->data != NULL) {
+        memused -= ep->sbuf.st_size;
+        Free(ep->data);
+    }
+    if (ep->gzdata != NULL) {
+        memused -= ep->gzsize;
+        Free(ep->gzdata);
+        Free(ep->gzhdrs);
+    }
+    Free(ep->hdrs);
+    Free(ep->filename);
+    Free(ep);
+}
+/* $end fdcachec */
@@ -0,0 +1,41 @@
+/*
+ * fdcache.h - small LRU cache of static files and their stat results,
+ *     shared by all threads of one Tiny process. With a memory budget
+ *     (tiny -m) small files are also kept in memory together with a
+ *     precompressed filename.gz, if there is one.
+ */
+#ifndef __FDCACHE_H__
+#define __FDCACHE_H__
+
+#include "csapp.h"
+
+#define FDCACHE_SIZE 64    /* Files kept per process */
+#define FDCACHE_CHECK 1    /* Seconds before a cached stat is rechecked */
+#define ASSET_MAX (1<<20)  /* Largest file kept in memory */
+
+/* $begin fdentt */
+typedef struct {
+    char *filename;        /* Path the file was opened as */
+    int fd;                /* Read-only descriptor, -1 if data is set */
+    struct stat sbuf;      /* fstat() result for the file */
+    char *hdrs;            /* Response headers after the Connection line */
+    int hdrlen;
+    char *data;            /* Whole file in memory, or NULL */
+    char *gzdata;          /* filename.gz in memory, or NULL */
+    off_t gzsize;
+    time_t gzmtime;
+    char *gzhdrs;          /* hdrs for the gzip variant */
+    int gzhdrlen;
+    time_t checked;        /* When sbuf was last compared with the path */
+    unsigned long lastuse; /* LRU clock value of the last hit */
+    int refcnt;            /* Requests currently sending from fd */
+    int cached;            /* Still in the table (else freed on last close) */
+} fdent_t;
+/* $end fdentt */
+
+void fdcache_init(size_t memmax);
+void fdcache_preload(char *dir);
+fdent_t *fdcache_open(char *filename);
+void fdcache_close(fdent_t *ep);
+
+#endif /* __FDCACHE_H__ */
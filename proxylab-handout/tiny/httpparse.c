@@ -0,0 +1,185 @@
+/*
+ * httpparse.c - incremental parser for HTTP/1.x request heads
+ *
+ *     Only complete lines are parsed. rp->line marks the first line
+ *     still to parse and rp->scanned how far memchr() has already
+ *     looked for its end, so feeding a head in many small reads costs
+ *     no more than parsing it once. Lines may end in "\r\n" or "\n";
+ *     names are matched without regard to case, as HTTP requires.
+ */
+/* $begin httpparsec */
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "httpparse.h"
+
+static int parse_request_line(http_req_t *rp, const char *buf, size_t end);
+static int parse_header(http_req_t *rp, const char *buf, size_t end);
+static int grow_hdrs(http_req_t *rp);
+static int is_tchar(unsigned char c);
+
+void http_init(http_req_t *rp)
+{
+    memset(&rp->method, 0, sizeof(http_span_t));
+    rp->nhdrs = 0;
+    rp->hdrs = rp->inl;
+    rp->maxhdrs = HTTP_INLHDRS;
+    rp->line = rp->scanned = 0;
+}
+
+/* http_free - give back a header array grown past HTTP_INLHDRS */
+void http_free(http_req_t *rp)
+{
+    if (rp->hdrs != rp->inl)
+        free(rp->hdrs);
+    rp->hdrs = rp->inl;
+    rp->maxhdrs = HTTP_INLHDRS;
+}
+
+/*
+ * http_parse_request - parse the request head at the start of the len
+ *     bytes in buf, of which an earlier call on rp may have seen a
+ *     prefix. Returns the length of the head once its blank line is in,
+ *     HTTP_PARTIAL if it is not yet, HTTP_BAD or HTTP_NOMEM. There is no
+ *     limit on the number of headers but the size of buf.
+ */
+int http_parse_request(http_req_t *rp, const char *buf, size_t len)
+{
+    const char *eol;
+    size_t end;
+
+    while ((eol = memchr(buf + rp->scanned, '\n', len - rp->scanned)) != NULL) {
+        end = eol - buf;             /* The line is buf[rp->line..end) */
+        rp->scanned = end + 1;
+        if (end > rp->line && buf[end - 1] == '\r')
+            end--;
+        /* A stray CR could end the line early for the next server to read it */
+        if (memchr(buf + rp->line, '\r', end - rp->line) != NULL)
+            return HTTP_BAD;
+        if (rp->method.len == 0) {
+            /* Blank lines before the request line are ignored */
+            if (end > rp->line && parse_request_line(rp, buf, end) < 0)
+                return HTTP_BAD;
+        }
+        else if (end == rp->line)    /* End of the head */
+            return rp->scanned;
+        else if (rp->nhdrs == rp->maxhdrs && grow_hdrs(rp) < 0)
+            return HTTP_NOMEM;
+        else if (parse_header(rp, buf, end) < 0)
+            return HTTP_BAD;
+        rp->line = rp->scanned;
+    }
+    rp->scanned = len;
+    return HTTP_PARTIAL;
+}
+
+/* http_span_is - does s hold str, ignoring case? */
+int http_span_is(const char *buf, http_span_t s, const char *str)
+{
+    return strlen(str) == s.len && !strncasecmp(buf + s.off, str, s.len);
+}
+
+/* http_header - the first header named name, or NULL */
+http_hdr_t *http_header(http_req_t *rp, const char *buf, const char *name)
+{
+    int i;
+
+    for (i = 0; i < rp->nhdrs; i++)
+        if (http_span_is(buf, rp->hdrs[i].name, name))
+            return &rp->hdrs[i];
+    return NULL;
+}
+
+/*
+ * http_span_str - terminate s in place and return it as a string. In
+ *     a parsed head every span is followed by a delimiter (a blank,
+ *     ':', '\r' or '\n'), which is what gets overwritten.
+ */
+char *http_span_str(char *buf, http_span_t s)
+{
+    buf[s.off + s.len] = '\0';
+    return buf + s.off;
+}
+
+/* "method SP request-target SP HTTP/1.x" in buf[rp->line..end) */
+static int parse_request_line(http_req_t *rp, const char *buf, size_t end)
+{
+    size_t p = rp->line, start;
+
+    for (start = p; p < end && is_tchar(buf[p]); p++)
+        ;
+    if (p == start || p == end || buf[p] != ' ')
+        return -1;
+    rp->method.off = start;
+    rp->method.len = p - start;
+
+    for (start = ++p; p < end && (unsigned char)buf[p] > ' ' && buf[p] != 0x7f; p++)
+        ;
+    if (p == start || p == end || buf[p] != ' ')
+        return -1;
+    rp->uri.off = start;
+    rp->uri.len = p - start;
+
+    start = p + 1;
+    if (end - start != 8 || strncmp(buf + start, "HTTP/1.", 7)
+        || buf[start + 7] < '0' || buf[start + 7] > '9')
+        return -1;
+    rp->version.off = start;
+    rp->version.len = 8;
+    rp->minor = buf[start + 7] - '0';
+    return 0;
+}
+
+/* "name: value" in buf[rp->line..end); obsolete line folding is refused */
+static int parse_header(http_req_t *rp, const char *buf, size_t end)
+{
+    size_t p = rp->line, start = p, vend;
+    http_hdr_t *hp;
+
+    while (p < end && is_tchar(buf[p]))
+        p++;
+    if (p == start || p == end || buf[p] != ':')
+        return -1;
+    hp = &rp->hdrs[rp->nhdrs];
+    hp->name.off = start;
+    hp->name.len = p - start;
+
+    for (p++; p < end && (buf[p] == ' ' || buf[p] == '\t'); p++)
+        ;
+    for (vend = end; vend > p && (buf[vend - 1] == ' ' || buf[vend - 1] == '\t'); vend--)
+        ;
+    hp->value.off = p;
+    hp->value.len = vend - p;
+    rp->nhdrs++;
+    return 0;
+}
+
+/* Double the header array, moving it off the struct the first time */
+static int grow_hdrs(http_req_t *rp)
+{
+    http_hdr_t *hdrs;
+
+    if (rp->hdrs == rp->inl) {
+        if ((hdrs = malloc(2 * rp->maxhdrs * sizeof(http_hdr_t))) != NULL)
+            memcpy(hdrs, rp->inl, rp->nhdrs * sizeof(http_hdr_t));
+    }
+    else
+        hdrs = realloc(rp->hdrs, 2 * rp->maxhdrs * sizeof(http_hdr_t));
+    if (hdrs == NULL)
+        return -1;
+    rp->hdrs = hdrs;
+    rp->maxhdrs *= 2;
+    return 0;
+}
+
+/* Characters allowed in methods and header names, as a bitmap of ASCII */
+static const unsigned int tchar_map[4] = {
+    0x00000000, 0x03ff6cfa, 0xc7fffffe, 0x57ffffff
+};
+
+static int is_tchar(unsigned char c)
+{
+    return c < 128 && (tchar_map[c >> 5] >> (c & 31) & 1);
+}
+/* $end httpparsec */
@@ -3,115 +3,449 @@
  * tiny.c - A simple, iterative HTTP/1.0 Web server that uses the 
  *     GET method to serve static and dynamic content.
  *
+ *     -w N serves connections from a pool of N threads instead, and
+ *     -p N forks N worker processes that each bind the port with
+ *     SO_REUSEPORT, so the kernel spreads connections across them.
+ *     The two can be combined.
+ *
+ *     In the thread-pool mode connections are persistent: requests,
+ *     including pipelined ones, are served until the client asks to
+ *     close or stays idle for KEEPALIVE_TIMEOUT seconds. A single
+ *     idle client would stall an iterative server, so without -w
+ *     every response still closes the connection.
+ *
+ *     -c N runs each CGI program as a pool of N long-lived workers
+ *     (see cgipool.h) instead of forking it for every request.
+ *
+ *     -e serves every connection from one thread with an edge-triggered
+ *     epoll loop (evloop.c) instead; with -p, one loop per process.
+ *
+ *     -m MB keeps static files, and any precompressed filename.gz, in
+ *     memory (see fdcache.h), loading ./ at startup; a hit is then a
+ *     single sendmsg() of headers and body.
+ *
+ *     Static files honor Range requests, answering with 206 and one
+ *     range or a multipart/byteranges body.
+ *
  * Updated 11/2019 droh 
  *   - Fixed sprintf() aliasing issue in serve_static(), and clienterror().
  */
 #include "csapp.h"
+#include "sbuf.h"
+#include "fdcache.h"
+#include "cgipool.h"
+#include "tiny.h"
+#include <sys/sendfile.h>
 
-void doit(int fd);
-void read_requesthdrs(rio_t *rp);
-int parse_uri(char *uri, char *filename, char *cgiargs);
-void serve_static(int fd, char *filename, int filesize);
-void get_filetype(char *filename, char *filetype);
-void serve_dynamic(int fd, char *filename, char *cgiargs);
-void clienterror(int fd, char *cause, char *errnum, 
-		 char *shortmsg, char *longmsg);
+#define SBUFSIZE 16
+#define BOUNDARY "TINY_BYTERANGES_c5b1e7f3" /* Separates multipart/byteranges parts */
+
+void serve(int listenfd, int nthreads, int events);
+void *worker(void *vargp);
+int open_reuseport_listenfd(char *port);
+void serve_conn(int fd);
+int doit(int fd, rio_t *rp);
+int read_request(rio_t *rp, char *head, http_req_t *reqp);
+int serve_static(int fd, fdent_t *ep, int http11, reqhdrs_t *hp);
+static void range_response(resp_t *rp, fdent_t *ep, int http11, reqhdrs_t *hp,
+                           int gz, char *body, off_t size, int n);
+static int range_head(char *buf, fdent_t *ep, int http11, int keep, int gz,
+                      char *status, char *type, off_t len, char *crange);
+static int clip_ranges(reqhdrs_t *hp, off_t size);
+static void iov_consume(resp_t *rp, size_t n);
+static void parse_ranges(char *p, reqhdrs_t *hp);
+static int takes_gzip(char *value);
+static char *skip_ows(char *p);
+
+sbuf_t sbuf; /* Shared buffer of connected descriptors */
+int persistent; /* Keep connections open between requests */
 
 int main(int argc, char **argv) 
 {
-    int listenfd, connfd;
-    char hostname[MAXLINE], port[MAXLINE];
-    socklen_t clientlen;
-    struct sockaddr_storage clientaddr;
+    int opt, i, nthreads = 0, nprocs = 0, ncgi = 0, events = 0;
+    long memmb = 0;
+    int listenfd;
+    pid_t pid;
 
     /* Check command line args */
-    if (argc != 2) {
-	fprintf(stderr, "usage: %s <port>\n", argv[0]);
+    while ((opt = getopt(argc, argv, "w:p:c:em:")) != -1) {
+	switch (opt) {
+	case 'm':
+	    memmb = atol(optarg);
+	    break;
+	case 'e':
+	    events = 1;
+	    break;
+	case 'c':
+	    ncgi = atoi(optarg);
+	    break;
+	case 'w':
+	    nthreads = atoi(optarg);
+	    break;
+	case 'p':
+	    nprocs = atoi(optarg);
+	    break;
+	default:
+	    optind = argc; /* Force the usage message */
+	}
+    }
+    if (optind != argc - 1 || nthreads < 0 || nprocs < 0 || ncgi < 0
+	|| memmb < 0 || (events && nthreads > 0)) {
+	fprintf(stderr, "usage: %s [-w threads | -e] [-p procs] [-c cgiworkers] [-m cachemb] <port>\n", argv[0]);
 	exit(1);
     }
+    cgipool_init(ncgi); /* Pools start lazily, in each prefork worker */
+    fdcache_init((size_t)memmb << 20);
+    if (memmb > 0)
+	fdcache_preload("."); /* Prefork workers share these pages */
 
-    listenfd = Open_listenfd(argv[1]);
+    Signal(SIGPIPE, SIG_IGN); /* A client closing early gets EPIPE instead */
+    if (nprocs == 0) {
+	listenfd = Open_listenfd(argv[optind]);
+	serve(listenfd, nthreads, events);
+    }
+
+    /* Prefork: each worker gets its own listening socket on the port */
+    if ((listenfd = open_reuseport_listenfd(argv[optind])) < 0)
+	unix_error("open_reuseport_listenfd error");
+    Close(listenfd); /* Only checked that the port is free */
+    for (i = 0; i < nprocs; i++) {
+	if (Fork() == 0) {
+	    if ((listenfd = open_reuseport_listenfd(argv[optind])) < 0)
+		unix_error("open_reuseport_listenfd error");
+	    serve(listenfd, nthreads, events);
+	}
+    }
+    while ((pid = wait(NULL)) > 0) { /* Replace workers that die */
+	fprintf(stderr, "worker %d exited, restarting\n", (int)pid);
+	if (Fork() == 0) {
+	    if ((listenfd = open_reuseport_listenfd(argv[optind])) < 0)
+		unix_error("open_reuseport_listenfd error");
+	    serve(listenfd, nthreads, events);
+	}
+    }
+    exit(0);
+}
+/* $end tinymain */
+
+/*
+ * serve - accept connections on listenfd forever, serving each one
+ *     in turn, handing it to a pool of nthreads threads if nthreads > 0,
+ *     or multiplexing them all in an event loop if events is set
+ */
+void serve(int listenfd, int nthreads, int events) 
+{
+    int i, connfd;
+    char hostname[MAXLINE], port[MAXLINE];
+    socklen_t clientlen;
+    struct sockaddr_storage clientaddr;
+    pthread_t tid;
+
+    if (events) {
+	persistent = 1;
+	event_loop(listenfd);
+    }
+    if (nthreads > 0) {
+	persistent = 1;
+	sbuf_init(&sbuf, SBUFSIZE);
+	for (i = 0; i < nthreads; i++)  /* Create worker threads */
+	    Pthread_create(&tid, NULL, worker, NULL);
+    }
     while (1) {
 	clientlen = sizeof(clientaddr);
 	connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen); //line:netp:tiny:accept
         Getnameinfo((SA *) &clientaddr, clientlen, hostname, MAXLINE, 
                     port, MAXLINE, 0);
         printf("Accepted connection from (%s, %s)\n", hostname, port);
-	doit(connfd);                                             //line:netp:tiny:doit
+	if (nthreads > 0) {
+	    sbuf_insert(&sbuf, connfd); /* Insert connfd in buffer */
+	    continue;
+	}
+	serve_conn(connfd);                                       //line:netp:tiny:doit
 	Close(connfd);                                            //line:netp:tiny:close
     }
 }
-/* $end tinymain */
+
+/* worker - thread routine that serves connections taken from sbuf */
+void *worker(void *vargp) 
+{
+    Pthread_detach(pthread_self());
+    while (1) {
+	int connfd = sbuf_remove(&sbuf); /* Remove connfd from buffer */
+	serve_conn(connfd);
+	Close(connfd);
+    }
+}
 
 /*
- * doit - handle one HTTP request/response transaction
+ * open_reuseport_listenfd - open_listenfd with SO_REUSEPORT set, so
+ *     that several processes can listen on the same port
+ */
+int open_reuseport_listenfd(char *port) 
+{
+    struct addrinfo hints, *listp, *p;
+    int listenfd = -1, optval = 1;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG | AI_NUMERICSERV;
+    if (getaddrinfo(NULL, port, &hints, &listp) != 0)
+        return -1;
+
+    for (p = listp; p; p = p->ai_next) {
+        if ((listenfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0) 
+            continue;
+        setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, (const void *)&optval, sizeof(int));
+        setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, (const void *)&optval, sizeof(int));
+        if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0)
+            break;
+        close(listenfd);
+    }
+    freeaddrinfo(listp);
+    if (!p || listen(listenfd, LISTENQ) < 0) {
+        if (p)
+            close(listenfd);
+        return -1;
+    }
+    return listenfd;
+}
+
+/*
+ * serve_conn - handle requests on one connection until the client
+ *     closes it, goes idle, or a response ends the connection
+ */
+void serve_conn(int fd) 
+{
+    rio_t rio;
+    struct timeval idle = { KEEPALIVE_TIMEOUT, 0 };
+
+    if (persistent)
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+    Rio_readinitb(&rio, fd); /* Pipelined requests wait in rio's buffer */
+    while (doit(fd, &rio))
+        ;
+}
+
+/*
+ * doit - handle one HTTP request/response transaction. Returns 1 if
+ *     the connection can carry another request.
  */
 /* $begin doit */
-void doit(int fd) 
+int doit(int fd, rio_t *rp) 
 {
-    int is_static;
+    int is_static, http11, keep;
+    reqhdrs_t hdrs;
     struct stat sbuf;
-    char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
+    fdent_t *ep;
+    http_req_t req;
+    char head[MAXBUF], *method, *uri;
     char filename[MAXLINE], cgiargs[MAXLINE];
-    rio_t rio;
 
     /* Read request line and headers */
-    Rio_readinitb(&rio, fd);
-    if (!Rio_readlineb(&rio, buf, MAXLINE))  //line:netp:doit:readrequest
-        return;
-    printf("%s", buf);
-    sscanf(buf, "%s %s %s", method, uri, version);       //line:netp:doit:parserequest
+    if (read_request(rp, head, &req) < 0)                //line:netp:doit:readrequest
+        return 0; /* Closed, idle too long, malformed, or error */
+    method = http_span_str(head, req.method);            //line:netp:doit:parserequest
+    uri = http_span_str(head, req.uri);
+    http11 = req.minor == 1;
+    hdrs.keep = http11; /* HTTP/1.1 connections are persistent by default */
+    hdrs.gzip = 0;
+    hdrs.nranges = 0;
+    request_headers(head, &req, &hdrs);                  //line:netp:doit:readrequesthdrs
+    hdrs.keep = hdrs.keep && persistent;
+    http_free(&req);
     if (strcasecmp(method, "GET")) {                     //line:netp:doit:beginrequesterr
         clienterror(fd, method, "501", "Not Implemented",
                     "Tiny does not implement this method");
-        return;
+        return 0;
     }                                                    //line:netp:doit:endrequesterr
-    read_requesthdrs(&rio);                              //line:netp:doit:readrequesthdrs
+    if (req.uri.len > MAXLINE - 16) { /* Leave room for "." and "home.html" */
+        clienterror(fd, "", "414", "URI Too Long",
+                    "Tiny does not take URIs this long");
+        return 0;
+    }
 
     /* Parse URI from GET request */
     is_static = parse_uri(uri, filename, cgiargs);       //line:netp:doit:staticcheck
+    if (is_static && (ep = fdcache_open(filename)) != NULL) { /* Hot files skip stat */
+	if (!(S_IRUSR & ep->sbuf.st_mode)) {
+	    fdcache_close(ep);
+	    clienterror(fd, filename, "403", "Forbidden",
+			"Tiny couldn't read the file");
+	    return 0;
+	}
+	keep = serve_static(fd, ep, http11, &hdrs);      //line:netp:doit:servestatic
+	fdcache_close(ep);
+	return keep;
+    }
     if (stat(filename, &sbuf) < 0) {                     //line:netp:doit:beginnotfound
 	clienterror(fd, filename, "404", "Not found",
 		    "Tiny couldn't find this file");
-	return;
+	return 0;
     }                                                    //line:netp:doit:endnotfound
 
-    if (is_static) { /* Serve static content */          
-	if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) { //line:netp:doit:readable
-	    clienterror(fd, filename, "403", "Forbidden",
-			"Tiny couldn't read the file");
-	    return;
-	}
-	serve_static(fd, filename, sbuf.st_size);        //line:netp:doit:servestatic
+    if (is_static) { /* Exists but could not be opened as a regular file */
+	clienterror(fd, filename, "403", "Forbidden",
+		    "Tiny couldn't read the file");       //line:netp:doit:readable
     }
     else { /* Serve dynamic content */
 	if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode)) { //line:netp:doit:executable
 	    clienterror(fd, filename, "403", "Forbidden",
 			"Tiny couldn't run the CGI program");
-	    return;
+	    return 0;
 	}
 	serve_dynamic(fd, filename, cgiargs);            //line:netp:doit:servedynamic
     }
+    return 0; /* CGI output is delimited by closing the connection */
 }
 /* $end doit */
 
 /*
- * read_requesthdrs - read HTTP request headers
+ * read_request - read a request head into head (MAXBUF bytes) one line
+ *     at a time, parsing it into *reqp as it grows. Returns 0, or -1 if
+ *     the client went away or sent a malformed or oversized head. On
+ *     success the caller must http_free() *reqp.
  */
-/* $begin read_requesthdrs */
-void read_requesthdrs(rio_t *rp) 
+/* $begin read_request */
+int read_request(rio_t *rp, char *head, http_req_t *reqp) 
 {
-    char buf[MAXLINE];
+    size_t len = 0;
+    ssize_t n;
+    int rc;
 
-    Rio_readlineb(rp, buf, MAXLINE);
-    printf("%s", buf);
-    while(strcmp(buf, "\r\n")) {          //line:netp:readhdrs:checkterm
-	Rio_readlineb(rp, buf, MAXLINE);
-	printf("%s", buf);
+    http_init(reqp);
+    do {
+	if (len == MAXBUF - 1 || (n = rio_readlineb(rp, head + len, MAXBUF - len)) <= 0) {
+	    http_free(reqp);
+	    return -1;
+	}
+	printf("%s", head + len);
+	len += n;
+    } while ((rc = http_parse_request(reqp, head, len)) == HTTP_PARTIAL); //line:netp:readhdrs:checkterm
+    if (rc < 0) {
+	http_free(reqp);
+	return -1;
     }
-    return;
+    return 0;
+}
+/* $end read_request */
+
+/*
+ * request_headers - fill *hp from the headers parsed into *reqp:
+ *     "Connection: close" or "keep-alive" sets keep, an
+ *     Accept-Encoding that takes gzip sets gzip, and Range sets ranges
+ */
+void request_headers(char *head, http_req_t *reqp, reqhdrs_t *hp) 
+{
+    http_hdr_t *h;
+    char *value;
+    int i;
+
+    for (i = 0; i < reqp->nhdrs; i++) {
+	h = &reqp->hdrs[i];
+	value = http_span_str(head, h->value);
+	if (http_span_is(head, h->name, "Connection")) {
+	    if (!strncasecmp(value, "close", 5))
+		hp->keep = 0;
+	    else if (!strncasecmp(value, "keep-alive", 10))
+		hp->keep = 1;
+	}
+	else if (http_span_is(head, h->name, "Accept-Encoding"))
+	    hp->gzip = takes_gzip(value);
+	else if (http_span_is(head, h->name, "Range"))
+	    parse_ranges(value, hp);
+    }
+}
+
+/*
+ * takes_gzip - does an Accept-Encoding value take gzip? Each coding
+ *     may carry parameters, with optional whitespace around ',', ';'
+ *     and '='; q=0 refuses it. "*" stands for any coding not listed.
+ */
+static int takes_gzip(char *value)
+{
+    char *p = value, *coding, *param;
+    size_t len, plen;
+    double q;
+    int star = 0;
+
+    while (*(p = skip_ows(p)) != '\0') {
+	if (*p == ',') {
+	    p++;
+	    continue;
+	}
+	for (coding = p; *p && *p != ',' && *p != ';' && *p != ' ' && *p != '\t'; p++)
+	    ;
+	len = p - coding;
+	q = 1;
+	while (*(p = skip_ows(p)) == ';') {  /* name [= value] */
+	    param = p = skip_ows(p + 1);
+	    while (*p && *p != '=' && *p != ',' && *p != ';' && *p != ' ' && *p != '\t')
+		p++;
+	    plen = p - param;
+	    if (*(p = skip_ows(p)) != '=')
+		continue;
+	    p = skip_ows(p + 1);
+	    if (plen == 1 && (*param == 'q' || *param == 'Q'))
+		q = strtod(p, NULL);
+	    while (*p && *p != ',' && *p != ';' && *p != ' ' && *p != '\t')
+		p++;
+	}
+	while (*p && *p != ',')  /* Skip anything malformed */
+	    p++;
+
+	if ((len == 4 && !strncasecmp(coding, "gzip", 4))
+	    || (len == 6 && !strncasecmp(coding, "x-gzip", 6)))
+	    return q > 0;
+	if (len == 1 && *coding == '*')
+	    star = q > 0;
+    }
+    return star;
+}
+
+/* skip_ows - skip optional whitespace (spaces and tabs) */
+static char *skip_ows(char *p)
+{
+    while (*p == ' ' || *p == '\t')
+	p++;
+    return p;
+}
+
+/*
+ * parse_ranges - read a "bytes=first-last,..." Range value into hp.
+ *     A malformed one, or one with more than MAXRANGES ranges, is
+ *     ignored and the whole file is sent.
+ */
+static void parse_ranges(char *p, reqhdrs_t *hp)
+{
+    range_t *r;
+
+    hp->nranges = 0;
+    if (strncasecmp(p, "bytes=", 6))
+	return;
+    for (p += 6; hp->nranges < MAXRANGES; p++) {
+	r = &hp->ranges[hp->nranges];
+	r->first = r->last = -1;
+	while (*p == ' ' || *p == '\t')
+	    p++;
+	if (isdigit(*p))
+	    r->first = strtoll(p, &p, 10);
+	if (*p++ != '-')
+	    break;
+	if (isdigit(*p))
+	    r->last = strtoll(p, &p, 10);
+	if ((r->first < 0 && r->last < 0) || (r->first >= 0 && r->last >= 0
+					      && r->last < r->first))
+	    break;
+	hp->nranges++;
+	while (*p == ' ' || *p == '\t')
+	    p++;
+	if (*p == '\0')
+	    return;
+	if (*p != ',')
+	    break;
+    }
+    hp->nranges = 0; /* Malformed, or too many ranges */
 }
-/* $end read_requesthdrs */
 
 /*
  * parse_uri - parse URI into filename and CGI args
@@ -146,31 +480,257 @@ int parse_uri(char *uri, char *filename, char *cgiargs)
 /* $end parse_uri */
 
 /*
- * serve_static - copy a file back to the client 
+ * serve_static - copy a file, or the byte ranges asked for, back to
+ *     the client. Headers and a body held in memory go out in one
+ *     sendmsg(); otherwise the headers are flagged MSG_MORE so they
+ *     share a packet with the start of the body, which follows straight
+ *     from the page cache with sendfile(). Returns hp->keep, or 0 if
+ *     the client went away.
  */
 /* $begin serve_static */
-void serve_static(int fd, char *filename, int filesize)
+int serve_static(int fd, fdent_t *ep, int http11, reqhdrs_t *hp)
+{
+    resp_t resp;
+    int ok;
+
+    static_response(&resp, ep, http11, hp); //line:netp:servestatic:beginserve
+    ok = send_response(fd, &resp) > 0;      //line:netp:servestatic:endserve
+    free_response(&resp);
+    return ok && hp->keep;
+}
+
+/*
+ * static_response - set up *rp to answer for ep: 200 with the headers
+ *     rendered by fdcache, or for a Range request 206 with one range or
+ *     a multipart/byteranges body, or 416 if no range is satisfiable.
+ *     Ranges count in the representation sent, gzipped if the client
+ *     takes it; that one is always in memory.
+ */
+void static_response(resp_t *rp, fdent_t *ep, int http11, reqhdrs_t *hp)
+{
+    static char *status[2][2] = {
+        { "HTTP/1.0 200 OK\r\nConnection: close\r\n",
+          "HTTP/1.0 200 OK\r\nConnection: keep-alive\r\n" },
+        { "HTTP/1.1 200 OK\r\nConnection: close\r\n",
+          "HTTP/1.1 200 OK\r\nConnection: keep-alive\r\n" }
+    };
+    int gz = hp->gzip && ep->gzdata != NULL;
+    char *body = gz ? ep->gzdata : ep->data;
+    off_t size = gz ? ep->gzsize : ep->sbuf.st_size;
+    int n = hp->nranges > 0 ? clip_ranges(hp, size) : -1;
+
+    memset(rp, 0, sizeof(resp_t));
+    rp->filefd = ep->fd;
+    if (n == 1 || (n > 1 && body != NULL)) {
+        range_response(rp, ep, http11, hp, gz, body, size, n);
+        return;
+    }
+    if (n > 1) { /* Map the file so the parts can go out as iovecs */
+        rp->map = mmap(NULL, size, PROT_READ, MAP_SHARED, ep->fd, 0);
+        if (rp->map != MAP_FAILED) {
+            rp->maplen = size;
+            range_response(rp, ep, http11, hp, gz, rp->map, size, n);
+            return;
+        }
+        rp->map = NULL; /* Send the whole file instead */
+    }
+    if (n == 0) {
+        range_response(rp, ep, http11, hp, gz, body, size, 0);
+        return;
+    }
+
+    rp->iov[0].iov_base = status[http11][hp->keep];
+    rp->iov[0].iov_len = strlen(rp->iov[0].iov_base);
+    rp->iov[1].iov_base = gz ? ep->gzhdrs : ep->hdrs;
+    rp->iov[1].iov_len = gz ? ep->gzhdrlen : ep->hdrlen;
+    rp->iovcnt = 2;
+    if (body != NULL) {
+        rp->iov[2].iov_base = body;
+        rp->iov[2].iov_len = size;
+        rp->iovcnt = 3;
+    }
+    else
+        rp->fileend = size;
+}
+
+/*
+ * range_response - the 206 response for the n clipped ranges in hp,
+ *     or the 416 response if n is 0. body is NULL if a single range is
+ *     to be sent from the file.
+ */
+static void range_response(resp_t *rp, fdent_t *ep, int http11, reqhdrs_t *hp,
+                           int gz, char *body, off_t size, int n)
+{
+    char filetype[MAXLINE], crange[MAXLINE], parts[MAXBUF];
+    int i, hdrlen, partlen[MAXRANGES], plen = 0;
+    off_t len = 0;
+    range_t *r;
+
+    get_filetype(ep->filename, filetype);
+    rp->buf = Malloc(MAXBUF);
+    if (n == 0) {
+        sprintf(crange, "bytes */%lld", (long long)size);
+        rp->iov[0].iov_len = range_head(rp->buf, ep, http11, hp->keep, gz,
+                                        "416 Range Not Satisfiable",
+                                        filetype, 0, crange);
+        rp->iov[0].iov_base = rp->buf;
+        rp->iovcnt = 1;
+        return;
+    }
+
+    if (n == 1) {
+        r = &hp->ranges[0];
+        sprintf(crange, "bytes %lld-%lld/%lld", (long long)r->first,
+                (long long)r->last, (long long)size);
+        hdrlen = range_head(rp->buf, ep, http11, hp->keep, gz,
+                            "206 Partial Content", filetype,
+                            r->last - r->first + 1, crange);
+        rp->iov[0].iov_base = rp->buf;
+        rp->iov[0].iov_len = hdrlen;
+        rp->iovcnt = 1;
+        if (body != NULL) {
+            rp->iov[1].iov_base = body + r->first;
+            rp->iov[1].iov_len = r->last - r->first + 1;
+            rp->iovcnt = 2;
+        }
+        else {
+            rp->fileoff = r->first;
+            rp->fileend = r->last + 1;
+        }
+        return;
+    }
+
+    /* Several ranges: each part gets its own small header */
+    for (i = 0; i < n; i++) {
+        r = &hp->ranges[i];
+        partlen[i] = snprintf(parts + plen, MAXBUF - plen, "\r\n--" BOUNDARY "\r\n"
+                              "Content-type: %s\r\n"
+                              "Content-range: bytes %lld-%lld/%lld\r\n\r\n",
+                              filetype, (long long)r->first,
+                              (long long)r->last, (long long)size);
+        plen += partlen[i];
+        len += partlen[i] + r->last - r->first + 1;
+    }
+    plen += sprintf(parts + plen, "\r\n--" BOUNDARY "--\r\n");
+    len += strlen("\r\n--" BOUNDARY "--\r\n");
+    hdrlen = range_head(rp->buf, ep, http11, hp->keep, gz, "206 Partial Content",
+                        "multipart/byteranges; boundary=" BOUNDARY, len, NULL);
+    memcpy(rp->buf + hdrlen, parts, plen);
+
+    rp->iov[0].iov_base = rp->buf;
+    rp->iov[0].iov_len = hdrlen;
+    rp->iovcnt = 1;
+    for (i = 0, plen = hdrlen; i < n; i++) {
+        r = &hp->ranges[i];
+        rp->iov[rp->iovcnt].iov_base = rp->buf + plen;
+        rp->iov[rp->iovcnt++].iov_len = partlen[i];
+        rp->iov[rp->iovcnt].iov_base = body + r->first;
+        rp->iov[rp->iovcnt++].iov_len = r->last - r->first + 1;
+        plen += partlen[i];
+    }
+    rp->iov[rp->iovcnt].iov_base = rp->buf + plen;
+    rp->iov[rp->iovcnt++].iov_len = strlen("\r\n--" BOUNDARY "--\r\n");
+}
+
+/* range_head - render the headers of a 206 or 416 response into buf */
+static int range_head(char *buf, fdent_t *ep, int http11, int keep, int gz,
+                      char *status, char *type, off_t len, char *crange)
 {
-    int srcfd;
-    char *srcp, filetype[MAXLINE], buf[MAXBUF];
+    return sprintf(buf, "HTTP/1.%d %s\r\n"
+                   "Connection: %s\r\n"
+                   "Server: Tiny Web Server\r\n"
+                   "Accept-Ranges: bytes\r\n"
+                   "Content-length: %lld\r\n"
+                   "Content-type: %s\r\n%s%s%s%s%s\r\n",
+                   http11, status, keep ? "keep-alive" : "close",
+                   (long long)len, type,
+                   crange != NULL ? "Content-range: " : "",
+                   crange != NULL ? crange : "",
+                   crange != NULL ? "\r\n" : "",
+                   gz ? "Content-Encoding: gzip\r\n" : "",
+                   ep->gzdata != NULL ? "Vary: Accept-Encoding\r\n" : "");
+}
+
+/*
+ * clip_ranges - resolve hp->ranges against a body of size bytes,
+ *     dropping those that start past its end. Returns how many are left.
+ */
+static int clip_ranges(reqhdrs_t *hp, off_t size)
+{
+    int i, n = 0;
+    range_t r;
+
+    for (i = 0; i < hp->nranges; i++) {
+        r = hp->ranges[i];
+        if (r.first < 0) { /* Suffix: the last r.last bytes */
+            if (r.last == 0 || size == 0)
+                continue;
+            r.first = r.last < size ? size - r.last : 0;
+            r.last = size - 1;
+        }
+        else if (r.first >= size)
+            continue;
+        else if (r.last < 0 || r.last >= size)
+            r.last = size - 1;
+        hp->ranges[n++] = r;
+    }
+    return n;
+}
+
+/*
+ * send_response - send what is left of *rp on fd. Returns 1 when it is
+ *     all sent, 0 if a non-blocking fd would block, -1 if the client
+ *     went away or the file shrank.
+ */
+int send_response(int fd, resp_t *rp)
+{
+    struct msghdr msg;
+    int more = rp->fileoff < rp->fileend;
+    ssize_t n;
+
+    memset(&msg, 0, sizeof(msg));
+    while (rp->iovfirst < rp->iovcnt) {
+        msg.msg_iov = rp->iov + rp->iovfirst;
+        msg.msg_iovlen = rp->iovcnt - rp->iovfirst;
+        if ((n = sendmsg(fd, &msg, more ? MSG_MORE : 0)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        iov_consume(rp, n);
+    }
+    while (rp->fileoff < rp->fileend) { //line:netp:servestatic:sendfile
+        if ((n = sendfile(fd, rp->filefd, &rp->fileoff, rp->fileend - rp->fileoff)) <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+    }
+    return 1;
+}
 
-    /* Send response headers to client */
-    get_filetype(filename, filetype);    //line:netp:servestatic:getfiletype
-    sprintf(buf, "HTTP/1.0 200 OK\r\n"); //line:netp:servestatic:beginserve
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Server: Tiny Web Server\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-length: %d\r\n", filesize);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-type: %s\r\n\r\n", filetype);
-    Rio_writen(fd, buf, strlen(buf));    //line:netp:servestatic:endserve
+/* iov_consume - drop n sent bytes from the front of rp->iov */
+static void iov_consume(resp_t *rp, size_t n)
+{
+    while (rp->iovfirst < rp->iovcnt && n >= rp->iov[rp->iovfirst].iov_len) {
+        n -= rp->iov[rp->iovfirst].iov_len;
+        rp->iovfirst++;
+    }
+    if (rp->iovfirst < rp->iovcnt) {
+        rp->iov[rp->iovfirst].iov_base = (char *)rp->iov[rp->iovfirst].iov_base + n;
+        rp->iov[rp->iovfirst].iov_len -= n;
+    }
+}
 
-    /* Send response body to client */
-    srcfd = Open(filename, O_RDONLY, 0); //line:netp:servestatic:open
-    srcp = Mmap(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0); //line:netp:servestatic:mmap
-    Close(srcfd);                       //line:netp:servestatic:close
-    Rio_writen(fd, srcp, filesize);     //line:netp:servestatic:write
-    Munmap(srcp, filesize);             //line:netp:servestatic:munmap
+/* free_response - release what static_response allocated for *rp */
+void free_response(resp_t *rp)
+{
+    if (rp->buf != NULL)
+        Free(rp->buf);
+    if (rp->map != NULL)
+        munmap(rp->map, rp->maplen);
+    rp->buf = NULL;
+    rp->map = NULL;
 }
 
 /*
@@ -197,21 +757,37 @@ void get_filetype(char *filename, char *filetype)
 /* $begin serve_dynamic */
 void serve_dynamic(int fd, char *filename, char *cgiargs) 
 {
-    char buf[MAXLINE], *emptylist[] = { NULL };
+    char buf[MAXLINE], *out, *emptylist[] = { NULL };
+    pid_t pid;
+    int n;
 
-    /* Return first part of HTTP response */
+    /* Return first part of HTTP response; stop if the client is gone */
     sprintf(buf, "HTTP/1.0 200 OK\r\n"); 
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Server: Tiny Web Server\r\n");
-    Rio_writen(fd, buf, strlen(buf));
+    sprintf(buf + strlen(buf), "Server: Tiny Web Server\r\n");
+    if (rio_writen(fd, buf, strlen(buf)) < 0)
+	return;
+
+    /* A pooled worker answers without a fork */
+    out = Malloc(CGI_MAXMSG);
+    if ((n = cgipool_run(filename, cgiargs, out)) >= 0) {
+	rio_writen(fd, out, n); /* Last write; if the client is gone, so is the output */
+	Free(out);
+	return;
+    }
+    Free(out);
   
-    if (Fork() == 0) { /* Child */ //line:netp:servedynamic:fork
+    if ((pid = fork()) < 0) { /* Out of processes: don't take the server down */
+	fprintf(stderr, "fork error: %s\n", strerror(errno));
+	return;
+    }
+    if (pid == 0) { /* Child */ //line:netp:servedynamic:fork
 	/* Real server would set all CGI vars here */
 	setenv("QUERY_STRING", cgiargs, 1); //line:netp:servedynamic:setenv
 	Dup2(fd, STDOUT_FILENO);         /* Redirect stdout to client */ //line:netp:servedynamic:dup2
 	Execve(filename, emptylist, environ); /* Run CGI program */ //line:netp:servedynamic:execve
     }
-    Wait(NULL); /* Parent waits for and reaps child */ //line:netp:servedynamic:wait
+    while (waitpid(pid, NULL, 0) < 0 && errno == EINTR) /* Parent waits for and reaps its own child */ //line:netp:servedynamic:wait
+	;
 }
 /* $end serve_dynamic */
 
@@ -222,24 +798,36 @@ void serve_dynamic(int fd, char *filename, char *cgiargs)
 void clienterror(int fd, char *cause, char *errnum, 
 		 char *shortmsg, char *longmsg) 
 {
-    char buf[MAXLINE];
-
-    /* Print the HTTP response headers */
-    sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-type: text/html\r\n\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-
-    /* Print the HTTP response body */
-    sprintf(buf, "<html><title>Tiny Error</title>");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "<body bgcolor=""ffffff"">\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "%s: %s\r\n", errnum, shortmsg);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "<p>%s: %s\r\n", longmsg, cause);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "<hr><em>The Tiny Web server</em>\r\n");
-    Rio_writen(fd, buf, strlen(buf));
+    char buf[MAXBUF];
+    int n;
+
+    n = error_response(buf, cause, errnum, shortmsg, longmsg);
+    rio_writen(fd, buf, n);
+}
+
+/*
+ * error_response - format a complete error response into buf (MAXBUF
+ *     bytes) and return its length. The connection is closed after it.
+ */
+int error_response(char *buf, char *cause, char *errnum, 
+		   char *shortmsg, char *longmsg) 
+{
+    char body[MAXBUF];
+    int n;
+
+    /* Build the HTTP response body */
+    n = snprintf(body, MAXBUF, "<html><title>Tiny Error</title>"
+		 "<body bgcolor=""ffffff"">\r\n"
+		 "%s: %s\r\n"
+		 "<p>%s: %.512s\r\n"
+		 "<hr><em>The Tiny Web server</em>\r\n",
+		 errnum, shortmsg, longmsg, cause);
+
+    /* Print the HTTP response headers in front of it */
+    return snprintf(buf, MAXBUF, "HTTP/1.0 %s %s\r\n"
+		    "Connection: close\r\n"
+		    "Content-type: text/html\r\n"
+		    "Content-length: %d\r\n\r\n%s",
+		    errnum, shortmsg, n, body);
 }
 /* $end clienterror */
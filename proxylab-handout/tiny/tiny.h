@@ -0,0 +1,61 @@
+/*
+ * tiny.h - pieces of tiny.c shared with the event loop in evloop.c
+ */
+#ifndef __TINY_H__
+#define __TINY_H__
+
+#include <sys/uio.h>
+
+#include "csapp.h"
+#include "fdcache.h"
+#include "httpparse.h"
+
+#define KEEPALIVE_TIMEOUT 5 /* Seconds an idle persistent connection is kept */
+#define MAXRANGES 8         /* A Range header with more is ignored */
+#define RESP_IOVMAX (2 * MAXRANGES + 2)
+
+extern int persistent;      /* Keep connections open between requests */
+
+/* One byte range of a Range header; -1 marks an omitted bound */
+typedef struct {
+    off_t first;            /* -1: the last "last" bytes */
+    off_t last;             /* -1: through the end */
+} range_t;
+
+/* What tiny uses from a request's headers */
+typedef struct {
+    int keep;               /* Connection stays open after the response */
+    int gzip;               /* Client accepts Content-Encoding: gzip */
+    int nranges;            /* 0 if the whole body was asked for */
+    range_t ranges[MAXRANGES];
+} reqhdrs_t;
+
+/* A static response: iov, then bytes [fileoff, fileend) of filefd */
+typedef struct {
+    struct iovec iov[RESP_IOVMAX];
+    int iovcnt;
+    int iovfirst;           /* iov[0..iovfirst) already sent */
+    int filefd;
+    off_t fileoff;
+    off_t fileend;
+    char *buf;              /* Headers rendered for this response, or NULL */
+    void *map;              /* File mapped for a multipart body, or NULL */
+    size_t maplen;
+} resp_t;
+
+void request_headers(char *head, http_req_t *reqp, reqhdrs_t *hp);
+int parse_uri(char *uri, char *filename, char *cgiargs);
+void static_response(resp_t *rp, fdent_t *ep, int http11, reqhdrs_t *hp);
+int send_response(int fd, resp_t *rp);
+void free_response(resp_t *rp);
+void get_filetype(char *filename, char *filetype);
+void serve_dynamic(int fd, char *filename, char *cgiargs);
+void clienterror(int fd, char *cause, char *errnum,
+                 char *shortmsg, char *longmsg);
+int error_response(char *buf, char *cause, char *errnum,
+                   char *shortmsg, char *longmsg);
+
+/* evloop.c */
+void event_loop(int listenfd);
+
+#endif /* __TINY_H__ */
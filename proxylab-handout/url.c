@@ -0,0 +1,87 @@
+/*
+ * url.c - parseUrl(), kept apart from proxy.c so urlbench can link it
+ */
+#include "csapp.h"
+#include "proxy.h"
+
+/*
+ * parseUrl - split an absolute http url into host, path and port in a
+ *     single pass, without allocating. host and position must hold
+ *     MAXLINE bytes. An IPv6 literal ("[::1]") is returned without its
+ *     brackets, a missing port means DEFAULT_PORT and an empty path
+ *     means "/". Returns 0 on success, -1 if url is not a valid http url.
+ */
+int parseUrl(const char* url, char* host, char* position, int* port)
+{
+    const char* p = url;
+    const char* hostStart;
+    const char* hostEnd;
+
+    if (strncasecmp(p, "http://", 7) != 0) {
+        return -1;
+    }
+    p += 7;
+
+    /* Skip userinfo: authority runs up to the first '/', '?' or '#' */
+    const char* authEnd = p + strcspn(p, "/?#");
+    const char* at = memchr(p, '@', authEnd - p);
+    if (at != NULL) {
+        p = at + 1;
+    }
+
+    if (*p == '[') { // IPv6 字面量
+        hostStart = p + 1;
+        hostEnd = memchr(hostStart, ']', authEnd - hostStart);
+        if (hostEnd == NULL) {
+            return -1;
+        }
+        p = hostEnd + 1;
+    } else {
+        hostStart = p;
+        while (p < authEnd && *p != ':') {
+            p++;
+        }
+        hostEnd = p;
+    }
+    if (hostEnd == hostStart || hostEnd - hostStart >= MAXLINE) {
+        return -1;
+    }
+
+    *port = DEFAULT_PORT;
+    if (p < authEnd && *p == ':') {
+        long val = 0;
+        for (p++; p < authEnd; p++) {
+            if (!isdigit((unsigned char)*p)) {
+                return -1;
+            }
+            val = val * 10 + (*p - '0');
+            if (val > 65535) {
+                return -1;
+            }
+        }
+        if (val != 0) { // "host:" 等价于默认端口
+            *port = val;
+        } else if (p[-1] != ':') {
+            return -1;
+        }
+    }
+    if (p != authEnd) {
+        return -1;
+    }
+
+    memcpy(host, hostStart, hostEnd - hostStart);
+    host[hostEnd - hostStart] = 0;
+
+    /* Path and query; the fragment is never sent to the server */
+    size_t len = strcspn(authEnd, "# ");
+    if (*authEnd != '/') {
+        position[0] = '/';
+        position++;
+    }
+    if (len >= MAXLINE - 1) {
+        return -1;
+    }
+    memcpy(position, authEnd, len);
+    position[len] = 0;
+    return 0;
+}
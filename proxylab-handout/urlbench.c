@@ -0,0 +1,129 @@
+/*
+ * urlbench.c - time parseUrl() against the regex parser it replaced
+ *
+ * Each parser splits every url of a fixed corpus many times over and
+ * the mean cost per url is printed. The regex version is kept here
+ * exactly as it was in proxy.c, compiling its pattern on every call,
+ * since that is what every request used to pay.
+ *
+ * usage: urlbench [rounds]
+ */
+#include <regex.h>
+
+#include "csapp.h"
+#include "proxy.h"
+
+#define DEFAULT_ROUNDS 20000
+
+static const char* corpus[] = {
+    "http://localhost:15213/home.html",
+    "http://localhost:15213/godzilla.jpg",
+    "http://www.cmu.edu/",
+    "http://www.cmu.edu",
+    "http://example.com:8080/index.html",
+    "http://cdn.example.net/static/js/app.min.js?v=20160208",
+    "http://images.example.org/a/b/c/d/e/f/photo-1024x768.png",
+    "http://api.example.com:8000/v1/search?q=proxy+lab&page=2&sort=asc",
+    "http://user:pw@intranet.example.com/wiki/Main_Page",
+    "http://[::1]:8080/status",
+    "http://news.example.com/2016/02/08/story.html#comments",
+    "http://localhost:15213/cgi-bin/adder?15213&18213",
+};
+#define NURLS (sizeof(corpus) / sizeof(corpus[0]))
+
+/* proxy.c's parseUrl before the single-pass parser, renamed */
+static int regexParseUrl(const char* url, char* host, char* position, int* port)
+{
+    char* pattern = "https?:\\/\\/([^/:]+)(:[0-9]*)?([^# ]*)";
+    regex_t reg;
+    int err;
+    char errbuf[1024];
+
+    if ((err = regcomp(&reg, pattern, REG_EXTENDED)) != 0) {
+        regerror(err, &reg, errbuf, sizeof(errbuf));
+        printf("err: %s\n", errbuf);
+        regfree(&reg);
+        exit(1);
+    }
+
+    size_t nmatch = 4;
+    regmatch_t pmatch[nmatch + 1];
+    err = regexec(&reg, url, nmatch, pmatch, 0);
+    if (err) {
+        regerror(err, &reg, errbuf, sizeof(errbuf));
+        printf("err: %s\n", errbuf);
+        regfree(&reg);
+        return -1;
+    }
+
+    int len = 0;
+    if (pmatch[1].rm_so != -1) {
+        len = pmatch[1].rm_eo - pmatch[1].rm_so;
+        memcpy(host, url + pmatch[1].rm_so, len);
+        host[len] = 0;
+    }
+
+    if (pmatch[2].rm_so != -1) {
+        len = pmatch[2].rm_eo - pmatch[2].rm_so - 1; // - 1 剪掉冒号长度
+        char tmp[64 + 1];
+        memcpy(tmp, url + pmatch[2].rm_so + 1, len); // + 1 除去冒号
+        tmp[len] = 0;
+        *port = atoi(tmp);
+    } else {
+        *port = DEFAULT_PORT;
+    }
+
+    if (pmatch[3].rm_so != -1) {
+        len = pmatch[3].rm_eo - pmatch[3].rm_so;
+        memcpy(position, url + pmatch[3].rm_so, len);
+        position[len] = 0;
+    }
+
+    regfree(&reg);
+    return 0;
+}
+
+static long nowNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/* Mean nanoseconds per url for parse over rounds passes of the corpus */
+static double run(int (*parse)(const char*, char*, char*, int*), long rounds)
+{
+    char host[MAXLINE], position[MAXLINE];
+    int port;
+    volatile int sink = 0;
+
+    long start = nowNs();
+    for (long r = 0; r < rounds; r++) {
+        for (size_t i = 0; i < NURLS; i++) {
+            sink += parse(corpus[i], host, position, &port) + port;
+        }
+    }
+    return (double)(nowNs() - start) / (rounds * NURLS);
+}
+
+int main(int argc, char** argv)
+{
+    long rounds = argc > 1 ? atol(argv[1]) : DEFAULT_ROUNDS;
+
+    if (rounds <= 0) {
+        fprintf(stderr, "usage: %s [rounds]\n", argv[0]);
+        exit(1);
+    }
+
+    /* The regex is a few hundred times slower; give it fewer rounds */
+    long regexRounds = rounds / 100 > 0 ? rounds / 100 : 1;
+    double before = run(regexParseUrl, regexRounds);
+    double after = run(parseUrl, rounds);
+
+    printf("parseUrl over %zu urls\n", NURLS);
+    printf("  regex (regcomp per call): %10.1f ns/url\n", before);
+    printf("  single pass:              %10.1f ns/url\n", after);
+    printf("  speedup:                  %10.0fx\n", before / after);
+    return 0;
+}